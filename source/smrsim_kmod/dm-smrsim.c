@@ -27,7 +27,16 @@
 #include <linux/gfp.h>
 #include <linux/mutex.h>
 #include <linux/math64.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
 #include <linux/version.h>
+#include <linux/miscdevice.h>
+#include <linux/ratelimit.h>
+#include <linux/fs.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
 #include "smrsim_types.h"
 #include "smrsim_ioctl.h"
 #include "smrsim_kapi.h"
@@ -36,6 +45,67 @@
 #define CREATE_TRACE_POINTS
 #include "smrsim_trace.h"
 
+/*
+ * Native zoned block device support: the bio target reports host managed
+ * zones. It needs the 5.5 bio and target API, which the smrsim_bio_*()
+ * helpers below map the bio path and the metadata IO onto; SMRSIM_IO_*
+ * are the metadata IO operations. Request based dm can't expose
+ * zones and dm dropped target ioctls in 4.6, so such a build has neither
+ * smrsim-rq nor the control ioctls.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0) && defined(DM_TARGET_ZONED_HM)
+#define SMRSIM_BLK_ZONED
+#endif
+
+#ifdef SMRSIM_BLK_ZONED
+#define smrsim_bio_flush(bio)    ((bio)->bi_opf & (REQ_PREFLUSH | REQ_FUA))
+#define smrsim_bio_endio(bio, error)                    \
+   do {                                                 \
+      (bio)->bi_status = errno_to_blk_status(error);    \
+      bio_endio(bio);                                   \
+   } while (0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+#define smrsim_bio_submit(bio)   submit_bio_noacct(bio)
+#else
+#define smrsim_bio_submit(bio)   generic_make_request(bio)
+#endif
+#ifndef ACCESS_ONCE
+#define ACCESS_ONCE(x)           (*(volatile typeof(x) *)&(x))
+#endif
+#ifndef REQ_FLUSH
+#define REQ_FLUSH                REQ_PREFLUSH
+#endif
+#define smrsim_bio_set_dev(bio, bdev)  bio_set_dev(bio, bdev)
+#define smrsim_bio_submit_rw(bio, rw)  do { (bio)->bi_opf = (rw); submit_bio(bio); } while (0)
+#define smrsim_bio_is_write(rw)  op_is_write(rw)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+#define SMRSIM_BIO_MAX_PAGES     BIO_MAX_VECS
+#else
+#define SMRSIM_BIO_MAX_PAGES     BIO_MAX_PAGES
+#endif
+#define SMRSIM_IO_READ           (REQ_OP_READ | REQ_SYNC)
+#define SMRSIM_IO_WRITE          REQ_OP_WRITE
+#define SMRSIM_IO_WRITE_FUA      (REQ_OP_WRITE | REQ_SYNC | REQ_FUA)
+#define SMRSIM_IO_WRITE_FLUSH    (REQ_OP_WRITE | REQ_SYNC | REQ_PREFLUSH | REQ_FUA)
+#else
+#define smrsim_bio_flush(bio)    ((bio)->bi_rw & (REQ_FLUSH | REQ_FUA))
+#define smrsim_bio_endio(bio, error)  bio_endio(bio, error)
+#define smrsim_bio_submit(bio)   generic_make_request(bio)
+#define smrsim_bio_set_dev(bio, bdev)  ((bio)->bi_bdev = (bdev))
+#define smrsim_bio_submit_rw(bio, rw)  submit_bio(rw, bio)
+#define smrsim_bio_is_write(rw)  ((rw) & WRITE)
+#define SMRSIM_BIO_MAX_PAGES     BIO_MAX_PAGES
+#define SMRSIM_IO_READ           READ_SYNC
+#define SMRSIM_IO_WRITE          WRITE
+#define SMRSIM_IO_WRITE_FUA      WRITE_FUA
+#define SMRSIM_IO_WRITE_FLUSH    WRITE_FLUSH_FUA
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define smrsim_bdev_bytes(bdev)  bdev_nr_bytes(bdev)
+#else
+#define smrsim_bdev_bytes(bdev)  i_size_read((bdev)->bd_inode)
+#endif
+
 #define SMR_ZONE_SIZE_SHIFT_DEFAULT    16    /* number of blocks/zone   */
 #define SMR_BLOCK_SIZE_SHIFT_DEFAULT   3     /* number of sectors/block */
 #define SMR_PAGE_SIZE_SHIFT_DEFAULT    3     /* number of sectors/page  */
@@ -54,15 +124,179 @@ __u32 VERSION = SMRSIM_VERSION(1, 0, 0);
 
 struct smrsim_c
 {
-   struct dm_dev *dev;   /* block_device     */
-   sector_t       start; /* starting address */
+   struct dm_dev           *dev;         /* block_device       */
+   sector_t                 start;       /* starting address   */
+   struct dm_dev           *meta_dev;    /* metadata, or NULL  */
+   struct workqueue_struct *delay_wq;    /* penalty dispatch   */
+   struct work_struct       delay_work;
+   struct timer_list        delay_timer;
+   struct list_head         delay_list;  /* bios held for penalty */
+   spinlock_t               delay_lock;
+   bool                     zone_split;  /* dm core splits bios at zones */
+   bool                     journal;     /* journaled metadata persistence */
+   __u32                    pstore_dirty;    /* writeback policy, 0 - off   */
+   unsigned int             pstore_age;      /* ms, 0 - default             */
+   bool                     pstore_flush;
+   bool                     pstore_sync;
+   bool                     pstore_compact;
+   struct dm_target        *ti;
+   struct work_struct       reorder_work;
+   struct timer_list        reorder_timer;
+   struct list_head         reorder_list;    /* writes held ahead of the WP */
+   spinlock_t               reorder_lock;
+   sector_t                 reorder_sectors; /* window, 0 - reorder off    */
+   unsigned int             reorder_ms;
+   unsigned int             reorder_queued;
+   __u64                    reorder_held;    /* writes that were reordered */
+   __u64                    reorder_expired;
+   __u64                    reorder_wait;    /* jiffies held in total      */
+   bool                     draining;        /* no holding, no timer re-arm */
+};
+
+/*
+ * per bio data - a bio passed under an out of policy flag is held on
+ * the device delay list until its penalty expires, a write ahead of the
+ * WP on the reorder list until the WP reaches it.
+ */
+struct smrsim_bio
+{
+   struct list_head  list;
+   struct bio       *bio;
+   unsigned long     expires;
+   sector_t          lba;       /* held at                */
+   bool              tracked;   /* write extent in flight */
+   bool              synced;    /* held for a metadata commit */
+   __u32             zone_idx;
+   __u32             start;     /* zone offsets, sectors  */
+   __u32             end;
+   __u32             gen;
+   __u32             epoch;
 };
 
-struct mutex                      smrsim_zone_lock;
+struct rw_semaphore               smrsim_zone_lock;
 struct mutex                      smrsim_ioct_lock;
 static struct smrsim_state       *zone_state = NULL;
 static struct smrsim_zone_status *zone_status= NULL;
 
+/*
+ * In-memory zone table
+ *
+ * The IO path and the zone scans work on packed per-field arrays rather
+ * than on the 24 byte struct smrsim_zone_status entries of the image, so
+ * a WP check touches a 4 byte WP and a type and condition byte. z_start
+ * and z_length follow from the index and the zone size, and
+ * z_checkpoint_offset is set by config only, so those stay in the
+ * image. smrsim_zone_fold() writes the arrays back into the image
+ * before it is persisted. Entries are guarded by the zone locks; the
+ * table is replaced along with zone_state and read under RCU by the
+ * read fast path.
+ *
+ * cmap holds a bitmap of zones per condition code, kept in step with
+ * cond by smrsim_zone_set_cond(), so condition queries visit only the
+ * zones that match. fmap does the same for free space, a bitmap per
+ * log2 bucket of the sectors left above the WP, kept by
+ * smrsim_zone_set_wp(). Bits are flipped atomically and may lag cond
+ * or wp for a moment: readers check them. The new bit is set before the
+ * old one is cleared, so a query never misses a zone in transit; the
+ * free space merge drops the duplicate.
+ *
+ * zmap mirrors wp, cond and type into a vmalloc_user() region that
+ * /dev/smrsim_zones maps read only (struct smrsim_zmap_hdr), so tools
+ * read WPs without an ioctl. smrsim_zmap_update() follows every change.
+ */
+#define SMR_ZONE_CONDS    16   /* z_conds is a 4 bit code */
+#define SMR_ZONE_BUCKETS  33   /* fls() of the free sectors */
+
+struct smrsim_zone_tbl {
+   __u32  num_zones;   /* capacity */
+   __u32 *wp;
+   __u8  *cond;
+   __u8  *type;
+   __u8  *flag;
+   unsigned long *cmap[SMR_ZONE_CONDS];
+   unsigned long *fmap[SMR_ZONE_BUCKETS];
+   struct smrsim_zmap_hdr *zmap;
+};
+
+static struct smrsim_zone_tbl __rcu *zone_tbl = NULL;
+static __u32 *zone_wp   = NULL;   /* z_write_ptr_offset */
+static __u8  *zone_cond = NULL;   /* z_conds            */
+static __u8  *zone_type = NULL;   /* z_type             */
+static __u8  *zone_flag = NULL;   /* z_flag             */
+static unsigned long **zone_cmap = NULL;   /* zones per condition */
+static unsigned long **zone_fmap = NULL;   /* zones per free bucket */
+static struct smrsim_zmap_hdr *zone_zmap = NULL;
+static DEFINE_MUTEX(smrsim_zmap_lock);     /* zone_zmap vs mmap */
+
+static void smrsim_zmap_update(__u32 zone_idx)
+{
+   struct smrsim_zmap_page *pg;
+
+   if (!zone_zmap) {
+      return;
+   }
+   pg = (struct smrsim_zmap_page *)((char *)zone_zmap + SMRSIM_ZMAP_PAGE) +
+        zone_idx / SMRSIM_ZMAP_ENTS;
+   ACCESS_ONCE(pg->ent[zone_idx % SMRSIM_ZMAP_ENTS]) =
+      SMRSIM_ZMAP_ENT(zone_wp[zone_idx], zone_cond[zone_idx], zone_type[zone_idx]);
+   smp_wmb();
+   atomic_inc((atomic_t *)&pg->gen);
+}
+
+/*
+ * Zones were added or cleared without reallocating the table.
+ */
+static void smrsim_zmap_resize(void)
+{
+   if (!zone_zmap) {
+      return;
+   }
+   ACCESS_ONCE(zone_zmap->num_zones) = SMR_NUMZONES;
+   smp_wmb();
+   atomic_inc((atomic_t *)&zone_zmap->gen);
+}
+
+static void smrsim_pstore_mark_zone(__u32 zone_idx);
+
+/*
+ * WP and condition changes go through smrsim_zone_set_cond() and
+ * smrsim_zone_set_wp(), which mark the zone for persistence, so a span
+ * moving several zones marks each of them.
+ */
+static void smrsim_zone_set_cond(__u32 zone_idx,
+                                 __u8 cond)
+{
+   __u8 old = zone_cond[zone_idx];
+
+   if (old == cond) {
+      return;
+   }
+   zone_cond[zone_idx] = cond;
+   set_bit(zone_idx, zone_cmap[cond & (SMR_ZONE_CONDS - 1)]);
+   clear_bit(zone_idx, zone_cmap[old & (SMR_ZONE_CONDS - 1)]);
+   smrsim_zmap_update(zone_idx);
+   smrsim_pstore_mark_zone(zone_idx);
+}
+
+/*
+ * Per-zone locking
+ *
+ * zone table and zone_stats[] entries are protected by a hashed array
+ * of seqlocks so that IO to independent zones scales across cores. The
+ * IO path takes smrsim_zone_lock shared; reconfiguration paths which
+ * resize or reallocate the zone table take it exclusive.
+ *
+ * Clean reads skip both locks: they snapshot the zone geometry under
+ * smrsim_conf_seq and the zone write pointer under its seqlock inside an
+ * RCU read section. Reconfiguration bumps smrsim_conf_seq around every
+ * change of the zone table, unpublishing it while a new one is built,
+ * and waits for a grace period before freeing a retired zone_state.
+ */
+#define SMR_ZONE_LOCK_NUM              BITS_PER_LONG
+static seqlock_t  smrsim_zlock[SMR_ZONE_LOCK_NUM];
+static spinlock_t smrsim_flock[SMR_ZONE_LOCK_NUM];  /* in-flight writes */
+static seqcount_t smrsim_conf_seq;
+
 /* 
  * debug error in simulate development stage - errors should be 
  * written to log page with sense codes in actual device.
@@ -107,49 +341,363 @@ static __u32 smrsim_wp_adjust_cnt  = 0;
 
 enum smrsim_conf_change {
    SMR_NO_CHANGE     = 0x00,
-   SMR_CONFIG_CHANGE = 0x01,
-   SMR_STATS_CHANGE  = 0x02,
-   SMR_STATUS_CHANGE = 0x04
+   SMR_CONFIG_CHANGE = 0x01
+};
+
+#define SMR_PSTORE_AGE     1000         /* default ms a change may wait */
+#define SMR_PSTORE_MAGIC   0x534D5243   /* "SMRC", per page crcs */
+#define SMR_PSTORE_SLOTS   2
+#define SMR_PSTORE_SLOT    SMRSIM_PSTORE_SLOT
+#define SMR_PSTORE_LOG     (2 << 20)    /* bytes of journal after the slots */
+#define SMR_PSTORE_LOG_MAGIC 0x534D524A /* "SMRJ" */
+#define SMR_PSTORE_CKPT    30000        /* ms between journal checkpoints */
+#define SMR_PSTORE_PAGES   (SMR_PSTORE_SLOT / PAGE_SIZE - 1) /* image pages per slot */
+#define SMR_PSTORE_FMT_RAW     1        /* the image, page by page */
+#define SMR_PSTORE_FMT_COMPACT 2        /* struct smrsim_pstore_chdr stream */
+#define SMR_PSTORE_CMAGIC  0x534D525A   /* "SMRZ" */
+#define SMR_PSTORE_CVERSION 1
+
+/*
+ * Persistence task
+ *
+ * A config change rewrites the whole image. Anything else marks the
+ * pages of zone_state it dirtied in the dirty bitmap, one bit per page,
+ * and the task writes back just those pages. Pages are marked under
+ * smrsim_zone_lock shared. Without a bitmap, dirty_all asks for a full
+ * save instead.
+ *
+ * The lock is held only to fold and copy the dirty pages into stage, a
+ * mirror of zone_state; the crcs and the IO run from the mirror after
+ * it's dropped. Checkpoints alternate between two slots past the last
+ * zone, each a descriptor page followed by the image. The descriptor,
+ * written last with FUA, commits the slot, and load takes the valid slot
+ * with the higher seq, so a torn checkpoint leaves the previous image.
+ * A slot is brought up to date with the pages dirtied since its last
+ * checkpoint: this one's plus prev, what went to the other slot.
+ *
+ * The descriptor holds a crc per image page, so a checkpoint hashes only
+ * the pages it writes. Load reports each page failing its crc and takes
+ * it from the other slot if that copy matches this image's crc, as a page
+ * unchanged between the checkpoints does. Otherwise the slot fails and
+ * load falls back to the older one whole, so an image never mixes two
+ * checkpoints.
+ *
+ * With compact set the image is written in the compact format instead:
+ * encoded from the stage after each checkpoint and written whole, its
+ * size following the zones that aren't empty or full and the stats that
+ * aren't zero. It's used only if its worst case fits a slot, and a zone
+ * count whose raw image can't fit is refused, so a checkpoint can't run
+ * out of room.
+ *
+ * In journal mode a WP or condition change also marks its zone in zmap,
+ * and every pass appends a record per marked zone to the log area after
+ * the slots, pages written with FUA. Checkpoints are taken only every
+ * SMR_PSTORE_CKPT ms, or once the log is half full; they restart the log
+ * under a new epoch, the seq of the image it applies to. Load replays
+ * the log pages of the loaded image's epoch onto it.
+ *
+ * The task sleeps on wq until a writeback is due: dirty_thresh newly
+ * dirty pages (or journaled zones), the first of them age_ms old, a host
+ * flush with on_flush set, or a config change. The map path counts and
+ * kicks; nothing polls.
+ *
+ * With sync set only a host flush writes metadata back: a completed flush
+ * or FUA write is held on sync_bios until the task has committed the
+ * dirty state, and fails if the commit does.
+ */
+struct smrsim_pstore_desc {
+   __u32  magic;
+   __u32  length;   /* image bytes       */
+   __u64  seq;
+   __u32  format;   /* SMR_PSTORE_FMT_*  */
+   __u32  bytes;    /* written after the descriptor */
+   __u32  crc32;    /* of pcrc[]         */
+   __u32  pcrc[];   /* per written page  */
+};
+
+/*
+ * Compact image, version 1. The image up to the zone stats follows the
+ * header as is, then the zone status table as runs of like zones and
+ * the zone stats that aren't zero:
+ *
+ *    run:   <zones> <kind> <type> <flag> <conds> <z_length>
+ *           kind SMR_PC_LIST: per zone [<z_start> <cp>] <zigzag WP delta>,
+ *           z_start and cp only with SMR_PC_RAW
+ *    stats: <entries>, per entry <zone gap> <5 counters>
+ *
+ * All numbers but kind, type and flag, bytes, are LEB128 varints.
+ */
+struct smrsim_pstore_chdr {
+   __u32  magic;
+   __u32  version;
+   __u32  length;   /* image bytes       */
+   __u32  num_zones;
+};
+
+enum smrsim_pc_kind {
+   SMR_PC_ZERO = 0x00,   /* WP 0          */
+   SMR_PC_FULL = 0x01,   /* WP at z_length */
+   SMR_PC_LIST = 0x02,   /* WP per zone   */
+   SMR_PC_RAW  = 0x04    /* z_start, cp per zone */
+};
+
+/*
+ * Worst case bytes per zone: a run of its own with every field at its
+ * widest (1 + 3 + 3 + 5 + 10 + 5 + 5), and a stats entry (6 * 5).
+ */
+#define SMR_PC_ZONE_MAX    32
+#define SMR_PC_STATS_MAX   30
+
+struct smrsim_pstore_rec {
+   __u32  zone_idx;
+   __u32  wp;       /* durable WP        */
+   __u32  seq;      /* within the epoch  */
+   __u16  cond;
+   __u16  rsvd;
+};
+
+struct smrsim_pstore_logpg {
+   __u32  magic;
+   __u32  crc32;    /* of the rest of the page */
+   __u64  epoch;
+   __u32  page;     /* index in the log  */
+   __u32  nr;       /* records           */
+   struct smrsim_pstore_rec rec[(PAGE_SIZE - 24) / sizeof(struct smrsim_pstore_rec)];
 };
 
-#define SMR_PSTORE_PG_EDG  92
-#define SMR_PSTORE_PG_OFF  40
-#define SMR_PSTORE_CHECK   1000
-#define SMR_PSTORE_QDEPTH  128
-#define SMR_PSTORE_PG_GAP  2
 static struct smrsim_pstore_task {
    struct task_struct    *pstore_thread; 
-   struct completion      read_event;
-   struct completion      write_event;
-   __u32                  sts_zone_idx;
-   __u32                  stu_zone_idx[SMR_PSTORE_QDEPTH];
-   __u8                   stu_zone_idx_cnt;
-   __u8                   stu_zone_idx_gap;
+   struct completion      io_event;
+   atomic_t               io_pending;
+   int                    io_err;
+   unsigned long         *dirty;
+   __u32                  num_pages;
+   bool                   dirty_all;
+   struct smrsim_state   *stage;
+   unsigned long         *stage_map;
+   unsigned long         *prev_map;
+   __u32                 *pcrc;
+   __u32                  stage_pages;
+   bool                   compact;
+   bool                   stage_compact;
+   unsigned char         *cbuf;         /* compact image */
+   __u64                  seq;
+   __u8                   slot;
+   bool                   journal;
+   unsigned long         *zmap;
+   __u32                  zmap_zones;
+   struct smrsim_pstore_logpg *log;
+   __u32                  log_head;
+   __u32                  log_rec;
+   __u64                  epoch;
+   unsigned long          ckpt_time;
+   wait_queue_head_t      wq;
+   atomic_t               ndirty;
+   unsigned long          dirty_since;   /* jiffies, 0 - clean */
+   __u32                  dirty_thresh;  /* 0 - off */
+   unsigned int           age_ms;
+   bool                   on_flush;
+   bool                   kick;
+   bool                   sync;
+   struct bio_list        sync_bios;
+   spinlock_t             sync_lock;
    sector_t               pstore_lba; 
    unsigned char          flag;
 } smrsim_ptask;
 
+static void smrsim_pstore_kick(void)
+{
+   smrsim_ptask.kick = true;
+   wake_up(&smrsim_ptask.wq);
+}
+
+/*
+ * Count a page or zone that just became dirty, waking the task on the
+ * first one, to time its age, and at the dirty threshold.
+ */
+static void smrsim_pstore_dirtied(void)
+{
+   if (!smrsim_ptask.dirty_since) {
+      smrsim_ptask.dirty_since = jiffies | 1;
+      wake_up(&smrsim_ptask.wq);
+   }
+   if (atomic_inc_return(&smrsim_ptask.ndirty) == smrsim_ptask.dirty_thresh) {
+      wake_up(&smrsim_ptask.wq);
+   }
+}
+
+/*
+ * Restart the writeback policy; what was dirty is being written.
+ * Caller holds smrsim_zone_lock exclusive.
+ */
+static void smrsim_pstore_clean(void)
+{
+   atomic_set(&smrsim_ptask.ndirty, 0);
+   smrsim_ptask.dirty_since = 0;
+   smrsim_ptask.kick = false;
+}
+
+/*
+ * Mark the pages holding len bytes at addr in zone_state dirty.
+ */
+static void smrsim_pstore_mark(void *addr,
+                               size_t len)
+{
+   unsigned long off = (unsigned char *)addr - (unsigned char *)zone_state;
+   unsigned long pg  = off / PAGE_SIZE;
+   unsigned long end = (off + len - 1) / PAGE_SIZE;
+
+   if (!smrsim_ptask.dirty) {
+      if (!smrsim_ptask.dirty_all) {
+         smrsim_ptask.dirty_all = true;
+         smrsim_pstore_dirtied();
+      }
+      return;
+   }
+   for (; (pg <= end) && (pg < smrsim_ptask.num_pages); pg++) {
+      if (!test_bit(pg, smrsim_ptask.dirty) &&
+          !test_and_set_bit(pg, smrsim_ptask.dirty)) {
+         smrsim_pstore_dirtied();
+      }
+   }
+}
+
+/*
+ * A WP or condition change of zone_idx.
+ */
+static void smrsim_pstore_mark_zone(__u32 zone_idx)
+{
+   smrsim_pstore_mark(&zone_status[zone_idx], sizeof(struct smrsim_zone_status));
+   if (smrsim_ptask.zmap && (zone_idx < smrsim_ptask.zmap_zones) &&
+       !test_bit(zone_idx, smrsim_ptask.zmap) &&
+       !test_and_set_bit(zone_idx, smrsim_ptask.zmap)) {
+      smrsim_pstore_dirtied();
+   }
+}
+
+static bool smrsim_pstore_journal(void)
+{
+   return smrsim_ptask.zmap && smrsim_ptask.log;
+}
+
+static bool smrsim_pstore_pending(void)
+{
+   return smrsim_ptask.dirty_all || (smrsim_ptask.dirty &&
+      (find_first_bit(smrsim_ptask.dirty, smrsim_ptask.num_pages) < smrsim_ptask.num_pages));
+}
+
+/*
+ * Size the dirty bitmap to the image. Caller holds smrsim_zone_lock
+ * exclusive, or runs in the constructor.
+ */
+static void smrsim_pstore_dirty_setup(void)
+{
+   __u32 num_pages = DIV_ROUND_UP(zone_state->header.length, PAGE_SIZE);
+
+   kfree(smrsim_ptask.dirty);
+   smrsim_ptask.num_pages = num_pages;
+   smrsim_ptask.dirty = kzalloc(BITS_TO_LONGS(num_pages) * sizeof(unsigned long),
+                                GFP_KERNEL);
+   if (!smrsim_ptask.dirty) {
+      printk(KERN_ERR "smrsim: no enough memory for the dirty page map, saving in full\n");
+      smrsim_ptask.num_pages = 0;
+   }
+   smrsim_ptask.dirty_all = false;
+   kfree(smrsim_ptask.zmap);
+   smrsim_ptask.zmap = NULL;
+   smrsim_ptask.zmap_zones = 0;
+   if (smrsim_ptask.journal) {
+      smrsim_ptask.zmap_zones = max(SMR_NUMZONES, SMR_NUMZONES_DEFAULT);
+      smrsim_ptask.zmap = kzalloc(BITS_TO_LONGS(smrsim_ptask.zmap_zones) *
+                                  sizeof(unsigned long), GFP_KERNEL);
+      if (!smrsim_ptask.zmap) {
+         printk(KERN_ERR "smrsim: no enough memory for the zone journal map, journal off\n");
+         smrsim_ptask.zmap_zones = 0;
+      }
+   }
+}
+
+static void smrsim_pstore_dirty_free(void)
+{
+   kfree(smrsim_ptask.dirty);
+   kfree(smrsim_ptask.zmap);
+   smrsim_ptask.dirty = NULL;
+   smrsim_ptask.zmap = NULL;
+   smrsim_ptask.num_pages = 0;
+   smrsim_ptask.zmap_zones = 0;
+}
+
 static __u32 smrsim_stats_size(void)
 {
    return (sizeof(struct smrsim_dev_stats) + sizeof(__u32) +
            sizeof(struct smrsim_zone_stats) * SMR_NUMZONES);
 }
 
-static __u32 smrsim_state_size(void)
+static __u32 smrsim_state_size_zones(__u32 num_zones)
 {
    return (sizeof(struct smrsim_state_header) +
            sizeof(struct smrsim_config) +
            sizeof(struct smrsim_dev_stats) + sizeof(__u32) +
-           SMR_NUMZONES * sizeof(struct smrsim_zone_stats) +
-           SMR_NUMZONES * sizeof(struct smrsim_zone_status) +
+           num_zones * sizeof(struct smrsim_zone_stats) +
+           num_zones * sizeof(struct smrsim_zone_status) +
            sizeof(__u32));
 }
 
+static __u32 smrsim_state_size(void)
+{
+   return smrsim_state_size_zones(SMR_NUMZONES);
+}
+
+static __u64 smrsim_pstore_compact_max(__u32 num_zones)
+{
+   return sizeof(struct smrsim_pstore_chdr) +
+          offsetof(struct smrsim_state, stats.zone_stats) + 5 +
+          (__u64)num_zones * (SMR_PC_ZONE_MAX + SMR_PC_STATS_MAX);
+}
+
+/*
+ * Whether every image of num_zones zones fits a slot. The compact one
+ * can outgrow the raw one, so the raw image has to fit; compact is used
+ * only when its worst case fits too.
+ */
+static bool smrsim_pstore_fits(__u32 num_zones)
+{
+   return DIV_ROUND_UP(smrsim_state_size_zones(num_zones), PAGE_SIZE) <= SMR_PSTORE_PAGES;
+}
+
 static __u32 num_sectors_zone(void)
 {
    return (1 << SMR_BLOCK_SIZE_SHIFT << SMR_ZONE_SIZE_SHIFT);
 }
 
+/*
+ * Free space bucket of a zone with WP wp: 0 when full, else n for
+ * 2^(n-1) <= free sectors < 2^n.
+ */
+static __u32 smrsim_zone_bucket(__u32 wp)
+{
+   return fls(num_sectors_zone() - wp);
+}
+
+static void smrsim_zone_set_wp(__u32 zone_idx,
+                               __u32 wp)
+{
+   __u32 old = smrsim_zone_bucket(zone_wp[zone_idx]);
+   __u32 bkt = smrsim_zone_bucket(wp);
+
+   if (zone_wp[zone_idx] == wp) {
+      return;
+   }
+   zone_wp[zone_idx] = wp;
+   if (old != bkt) {
+      /* never out of both buckets for a concurrent query */
+      set_bit(zone_idx, zone_fmap[bkt]);
+      clear_bit(zone_idx, zone_fmap[old]);
+   }
+   smrsim_zmap_update(zone_idx);
+   smrsim_pstore_mark_zone(zone_idx);
+}
+
 static __u64 zone_idx_lba(__u64 idx)
 {
    return (idx << SMR_BLOCK_SIZE_SHIFT << SMR_ZONE_SIZE_SHIFT);
@@ -164,421 +712,1952 @@ static __u64 index_power_of_2(__u64 num)
    return index;
 }
 
-static void smrsim_dev_idle_init(void)
+/*
+ * Build the set of zone locks covering zones sidx..eidx. A bio touches
+ * at most a couple of zones so the mask stays small.
+ */
+static unsigned long smrsim_zlock_mask(__u32 sidx,
+                                       __u32 eidx)
 {
-   trace_smrsim_gen_evt("dm-smrsim", "idle initialization");
-   smrsim_dev_idle_checkpoint = jiffies;
-   zone_state->stats.dev_stats.idle_stats.dev_idle_time_max = 0;
-   zone_state->stats.dev_stats.idle_stats.dev_idle_time_min = jiffies / HZ;
+   unsigned long mask = 0;
+   __u32 idx;
+
+   if (eidx >= SMR_NUMZONES) {
+      eidx = SMR_NUMZONES - 1;
+   }
+   for (idx = sidx; idx <= eidx; idx++) {
+      mask |= 1UL << (idx % SMR_ZONE_LOCK_NUM);
+      if (~mask == 0) {
+         break;
+      }
+   }
+   return mask;
 }
 
-static void smrsim_init_zone_default(__u64 sizedev)
+/*
+ * Zone locks are always taken in ascending lock index order, with
+ * smrsim_zone_lock held, which lockdep is told nests them all.
+ */
+static void smrsim_zlock_acquire(unsigned long mask)
 {
-   trace_smrsim_gen_evt("dm-smrsim", "zone default initialization");
-   SMR_CAPACITY = sizedev;
-   SMR_ZONE_SIZE_SHIFT = SMR_ZONE_SIZE_SHIFT_DEFAULT;
-   SMR_BLOCK_SIZE_SHIFT = SMR_BLOCK_SIZE_SHIFT_DEFAULT;
-   SMR_NUMZONES = (SMR_CAPACITY >> SMR_BLOCK_SIZE_SHIFT) 
-                                >> SMR_ZONE_SIZE_SHIFT;
-   SMR_NUMZONES_DEFAULT = SMR_NUMZONES;
-   printk(KERN_INFO "smrsim_init_zone_state: numzones=%d sizedev=%llu\n",
-      SMR_NUMZONES, sizedev);
-} 
+   unsigned long bit;
 
-static void smrsim_init_zone_status(void)
+   for_each_set_bit(bit, &mask, SMR_ZONE_LOCK_NUM) {
+      spin_lock_nest_lock(&smrsim_zlock[bit].lock, &smrsim_zone_lock);
+      write_seqcount_begin(&smrsim_zlock[bit].seqcount);
+   }
+}
+
+static void smrsim_zlock_release(unsigned long mask)
 {
-   __u32 i;
+   unsigned long bit;
 
-   for(i=0; i< SMR_NUMZONES; i++)
-   {
-      zone_status[i].z_start = i;
-      zone_status[i].z_length = num_sectors_zone();
-      zone_status[i].z_write_ptr_offset = 0;
-      zone_status[i].z_checkpoint_offset = 0;
-      zone_status[i].z_type  =
-         (SMR_NUMZONES > 1) && (!i || (SMR_NUMZONES-1) == i) ?
-         Z_TYPE_CONVENTIONAL : Z_TYPE_SEQUENTIAL;
-      zone_status[i].z_conds = 
-         (SMR_NUMZONES > 1) && (!i || (SMR_NUMZONES-1) == i) ?
-         Z_COND_NO_WP : Z_COND_EMPTY;
-      zone_status[i].z_flag = 0;
+   for_each_set_bit(bit, &mask, SMR_ZONE_LOCK_NUM) {
+      write_seqcount_end(&smrsim_zlock[bit].seqcount);
+      spin_unlock(&smrsim_zlock[bit].lock);
+   }
+}
+
+static void smrsim_zlock_init(void)
+{
+   __u32 idx;
+
+   for (idx = 0; idx < SMR_ZONE_LOCK_NUM; idx++) {
+      seqlock_init(&smrsim_zlock[idx]);
+      spin_lock_init(&smrsim_flock[idx]);
+   }
+   seqcount_init(&smrsim_conf_seq);
+}
+
+/*
+ * Free a zone_state replaced under smrsim_conf_seq once no lockless
+ * reader can still be looking at it.
+ */
+static void smrsim_state_retire(struct smrsim_state *sta)
+{
+   synchronize_rcu();
+   vfree(sta);
+}
+
+/*
+ * Violation counters
+ *
+ * The rule checks count into per-CPU 64-bit arrays rather than the
+ * __u32 zone_stats image, so a hot zone doesn't bounce one cache line
+ * between cores and long runs don't wrap. The image is folded in
+ * (saturated) only when the stats are read or persisted; the 64-bit
+ * totals are reported by IOCTL_SMRSIM_GET_STATS64.
+ *
+ * Increments happen under the zone lock with smrsim_zone_lock shared;
+ * (re)allocation and reset need smrsim_zone_lock exclusive or the zone
+ * lock of the zone being reset.
+ */
+enum smrsim_stat_ctr {
+   SMR_STAT_R_BEYOND_SWP = 0,
+   SMR_STAT_R_SPAN_ZONES,
+   SMR_STAT_W_NOT_ON_SWP,
+   SMR_STAT_W_SPAN_ZONES,
+   SMR_STAT_W_UNALIGNED,
+   SMR_STAT_NUM
+};
+
+static struct smrsim_stat_ctrs {
+   __u64  *base;       /* values seeded from the image  */
+   __u64 **pcpu;       /* increments per possible cpu   */
+   __u32   num_zones;  /* 0 - count in the image itself */
+} smrsim_ctrs;
+
+static __u32 *smrsim_stat_field(__u32 zone_idx,
+                                enum smrsim_stat_ctr ctr)
+{
+   struct smrsim_zone_stats *zs = &zone_state->stats.zone_stats[zone_idx];
+
+   switch (ctr) {
+      case SMR_STAT_R_BEYOND_SWP:
+         return &zs->out_of_policy_read_stats.beyond_swp_count;
+      case SMR_STAT_R_SPAN_ZONES:
+         return &zs->out_of_policy_read_stats.span_zones_count;
+      case SMR_STAT_W_NOT_ON_SWP:
+         return &zs->out_of_policy_write_stats.not_on_swp_count;
+      case SMR_STAT_W_SPAN_ZONES:
+         return &zs->out_of_policy_write_stats.span_zones_count;
+      default:
+         return &zs->out_of_policy_write_stats.unaligned_count;
+   }
+}
+
+static void smrsim_stat_free(void)
+{
+   int cpu;
+
+   if (smrsim_ctrs.pcpu) {
+      for_each_possible_cpu(cpu) {
+         vfree(smrsim_ctrs.pcpu[cpu]);
+      }
+      kfree(smrsim_ctrs.pcpu);
+   }
+   vfree(smrsim_ctrs.base);
+   memset(&smrsim_ctrs, 0, sizeof(struct smrsim_stat_ctrs));
+}
+
+/*
+ * Size the counters for the zone table, leaving room for zones added
+ * back up to the default count, and seed them from the image.
+ */
+static int smrsim_stat_setup(void)
+{
+   __u32  num_zones = max(SMR_NUMZONES, SMR_NUMZONES_DEFAULT);
+   size_t size = (size_t)num_zones * SMR_STAT_NUM * sizeof(__u64);
+   __u32  idx;
+   int    ctr;
+   int    cpu;
+
+   smrsim_stat_free();
+   smrsim_ctrs.base = vzalloc(size);
+   smrsim_ctrs.pcpu = kcalloc(nr_cpu_ids, sizeof(__u64 *), GFP_KERNEL);
+   if (!smrsim_ctrs.base || !smrsim_ctrs.pcpu) {
+      goto nomem;
+   }
+   for_each_possible_cpu(cpu) {
+      smrsim_ctrs.pcpu[cpu] = vzalloc(size);
+      if (!smrsim_ctrs.pcpu[cpu]) {
+         goto nomem;
+      }
+   }
+   for (idx = 0; idx < SMR_NUMZONES; idx++) {
+      for (ctr = 0; ctr < SMR_STAT_NUM; ctr++) {
+         smrsim_ctrs.base[idx * SMR_STAT_NUM + ctr] = *smrsim_stat_field(idx, ctr);
+      }
+   }
+   smrsim_ctrs.num_zones = num_zones;
+   return 0;
+   nomem:
+   printk(KERN_ERR "smrsim: no enough memory for per-cpu stats, counting in place\n");
+   smrsim_stat_free();
+   return -ENOMEM;
+}
+
+static void smrsim_stat_inc(__u32 zone_idx,
+                            enum smrsim_stat_ctr ctr)
+{
+   if (zone_idx >= smrsim_ctrs.num_zones) {
+      (*smrsim_stat_field(zone_idx, ctr))++;
+   } else {
+      smrsim_ctrs.pcpu[get_cpu()][zone_idx * SMR_STAT_NUM + ctr]++;
+      put_cpu();
+   }
+   smrsim_pstore_mark(&zone_state->stats.zone_stats[zone_idx],
+                      sizeof(struct smrsim_zone_stats));
+}
+
+static __u64 smrsim_stat_sum(__u32 zone_idx,
+                             enum smrsim_stat_ctr ctr)
+{
+   __u32 off = zone_idx * SMR_STAT_NUM + ctr;
+   __u64 sum;
+   int   cpu;
+
+   if (zone_idx >= smrsim_ctrs.num_zones) {
+      return *smrsim_stat_field(zone_idx, ctr);
+   }
+   sum = smrsim_ctrs.base[off];
+   for_each_possible_cpu(cpu) {
+      sum += ACCESS_ONCE(smrsim_ctrs.pcpu[cpu][off]);
+   }
+   return sum;
+}
+
+/*
+ * Refresh the __u32 image of zones sidx..eidx-1 from the counters.
+ */
+static void smrsim_stat_fold(__u32 sidx,
+                             __u32 eidx)
+{
+   __u32 idx;
+   int   ctr;
+
+   eidx = min(eidx, min(SMR_NUMZONES, smrsim_ctrs.num_zones));
+   for (idx = sidx; idx < eidx; idx++) {
+      for (ctr = 0; ctr < SMR_STAT_NUM; ctr++) {
+         *smrsim_stat_field(idx, ctr) = min_t(__u64, smrsim_stat_sum(idx, ctr), ~(__u32)0);
+      }
+   }
+}
+
+static void smrsim_stat_clear(__u32 zone_idx)
+{
+   __u32 off = zone_idx * SMR_STAT_NUM;
+   int   cpu;
+
+   if (zone_idx >= smrsim_ctrs.num_zones) {
+      return;
+   }
+   memset(&smrsim_ctrs.base[off], 0, SMR_STAT_NUM * sizeof(__u64));
+   for_each_possible_cpu(cpu) {
+      memset(&smrsim_ctrs.pcpu[cpu][off], 0, SMR_STAT_NUM * sizeof(__u64));
+   }
+}
+
+/*
+ * In-flight writes and the durable write pointer
+ *
+ * z_write_ptr_offset is the submitted WP: it moves when a write is
+ * mapped, so rule checks allow more than one write per zone in flight.
+ * Each mapped write to a sequential zone is tracked as an extent and
+ * the durable WP (dwp) only advances over extents that completed
+ * successfully, in WP order. A failed write moves the submitted WP back
+ * to its start the next time the zone is mapped; writes that were in
+ * flight beyond that point are then never committed. With nothing in
+ * flight and no failure pending the durable WP equals the submitted WP.
+ *
+ * The table is replaced along with zone_state and read under RCU from
+ * completion context; zone entries are guarded by irq safe hashed locks
+ * nested inside the zone locks.
+ */
+#define SMR_WP_NONE  (~(__u32)0)
+
+struct smrsim_zone_flight {
+   __u32            dwp;       /* valid while writes are in flight  */
+   __u32            inflight;  /* writes mapped but not completed   */
+   __u32            gen;       /* bumped whenever the WP moves back */
+   __u32            rollback;  /* offset the WP last moved back to  */
+   __u32            err_wp;    /* failed write pending roll back    */
+   struct list_head done;      /* completed ahead of the dwp        */
+};
+
+struct smrsim_flight_extent {
+   struct list_head list;
+   __u32            start;
+   __u32            end;
+};
+
+struct smrsim_flight {
+   __u32                     epoch;
+   __u32                     num_zones;
+   struct smrsim_zone_flight zones[0];
+};
+
+static struct smrsim_flight __rcu *smrsim_flight = NULL;
+static __u32                       smrsim_flight_epoch;
+
+/*
+ * Callers hold smrsim_zone_lock, or run in the constructor/destructor.
+ */
+static struct smrsim_flight *smrsim_flight_table(void)
+{
+   return rcu_dereference_protected(smrsim_flight, 1);
+}
+
+static void smrsim_flight_drop(struct smrsim_zone_flight *zf,
+                               __u32 from)
+{
+   struct smrsim_flight_extent *ext;
+   struct smrsim_flight_extent *next;
+
+   list_for_each_entry_safe(ext, next, &zf->done, list) {
+      if (ext->end > from) {
+         list_del(&ext->list);
+         kfree(ext);
+      }
+   }
+}
+
+static void smrsim_flight_free(void)
+{
+   struct smrsim_flight *fl = smrsim_flight_table();
+   __u32 idx;
+
+   rcu_assign_pointer(smrsim_flight, NULL);
+   if (!fl) {
+      return;
+   }
+   synchronize_rcu();
+   for (idx = 0; idx < fl->num_zones; idx++) {
+      smrsim_flight_drop(&fl->zones[idx], 0);
+   }
+   vfree(fl);
+}
+
+/*
+ * Rebuild the table for a new zone table; writes still in flight
+ * against the old one complete untracked.
+ */
+static int smrsim_flight_setup(void)
+{
+   struct smrsim_flight *fl;
+   __u32 num_zones = max(SMR_NUMZONES, SMR_NUMZONES_DEFAULT);
+   __u32 idx;
+
+   smrsim_flight_free();
+   fl = vzalloc(sizeof(struct smrsim_flight) + 
+                num_zones * sizeof(struct smrsim_zone_flight));
+   if (!fl) {
+      printk(KERN_ERR "smrsim: no enough memory for in-flight write tracking\n");
+      return -ENOMEM;
+   }
+   fl->epoch = ++smrsim_flight_epoch;
+   fl->num_zones = num_zones;
+   for (idx = 0; idx < num_zones; idx++) {
+      fl->zones[idx].err_wp = SMR_WP_NONE;
+      INIT_LIST_HEAD(&fl->zones[idx].done);
+   }
+   rcu_assign_pointer(smrsim_flight, fl);
+   return 0;
+}
+
+/*
+ * The WP of zone_idx was set to wp outside of the write path (reset,
+ * reconfiguration): forget what is in flight.
+ */
+static void smrsim_flight_reset(__u32 zone_idx,
+                                __u32 wp)
+{
+   struct smrsim_flight      *fl = smrsim_flight_table();
+   struct smrsim_zone_flight *zf;
+   spinlock_t                *fk = &smrsim_flock[zone_idx % SMR_ZONE_LOCK_NUM];
+   unsigned long              flags;
+
+   if (!fl || zone_idx >= fl->num_zones) {
+      return;
+   }
+   zf = &fl->zones[zone_idx];
+   spin_lock_irqsave(fk, flags);
+   zf->gen++;
+   zf->rollback = wp;
+   zf->dwp = wp;
+   zf->err_wp = SMR_WP_NONE;
+   smrsim_flight_drop(zf, 0);
+   spin_unlock_irqrestore(fk, flags);
+}
+
+/*
+ * Apply a pending failed write to the submitted WP. Caller holds the
+ * zone lock.
+ */
+static void smrsim_flight_sync(__u32 zone_idx)
+{
+   struct smrsim_flight      *fl = smrsim_flight_table();
+   struct smrsim_zone_flight *zf;
+   spinlock_t                *fk = &smrsim_flock[zone_idx % SMR_ZONE_LOCK_NUM];
+   unsigned long              flags;
+
+   if (!fl || zone_idx >= fl->num_zones) {
+      return;
+   }
+   zf = &fl->zones[zone_idx];
+   spin_lock_irqsave(fk, flags);
+   if (zf->err_wp != SMR_WP_NONE) {
+      if (zf->err_wp < zone_wp[zone_idx]) {
+         smrsim_zone_set_wp(zone_idx, zf->err_wp);
+         if (zone_type[zone_idx] == Z_TYPE_SEQUENTIAL) {
+            smrsim_zone_set_cond(zone_idx, zf->err_wp ? Z_COND_CLOSED : Z_COND_EMPTY);
+         }
+      }
+      zf->err_wp = SMR_WP_NONE;
+   }
+   spin_unlock_irqrestore(fk, flags);
+}
+
+/*
+ * A write moved the submitted WP of zone_idx from swp to end; track
+ * start..end until it completes. Caller holds the zone lock.
+ */
+static void smrsim_flight_start(struct smrsim_bio *sb,
+                                __u32 zone_idx,
+                                __u32 swp,
+                                __u32 start,
+                                __u32 end)
+{
+   struct smrsim_flight      *fl = smrsim_flight_table();
+   struct smrsim_zone_flight *zf;
+   spinlock_t                *fk = &smrsim_flock[zone_idx % SMR_ZONE_LOCK_NUM];
+   unsigned long              flags;
+
+   if (!sb || !fl || zone_idx >= fl->num_zones || end <= start) {
+      return;
+   }
+   zf = &fl->zones[zone_idx];
+   spin_lock_irqsave(fk, flags);
+   if (!zf->inflight && (zf->err_wp == SMR_WP_NONE)) {
+      zf->dwp = swp;
+   }
+   if (start < zf->dwp) {
+      zf->gen++;
+      zf->rollback = start;
+      zf->dwp = start;
+      smrsim_flight_drop(zf, start);
+   }
+   zf->inflight++;
+   sb->tracked  = true;
+   sb->zone_idx = zone_idx;
+   sb->start    = start;
+   sb->end      = end;
+   sb->gen      = zf->gen;
+   sb->epoch    = fl->epoch;
+   spin_unlock_irqrestore(fk, flags);
+}
+
+static void smrsim_flight_commit(struct smrsim_zone_flight *zf,
+                                 struct smrsim_bio *sb)
+{
+   struct smrsim_flight_extent *ext;
+   struct smrsim_flight_extent *next;
+   struct list_head            *pos = &zf->done;
+
+   if (sb->start != zf->dwp) {
+      ext = kmalloc(sizeof(struct smrsim_flight_extent), GFP_ATOMIC);
+      if (!ext) {
+         return;
+      }
+      ext->start = sb->start;
+      ext->end = sb->end;
+      list_for_each_entry(next, &zf->done, list) {
+         if (next->start > ext->start) {
+            pos = &next->list;
+            break;
+         }
+      }
+      list_add_tail(&ext->list, pos);
+      return;
+   }
+   zf->dwp = sb->end;
+   list_for_each_entry_safe(ext, next, &zf->done, list) {
+      if (ext->start > zf->dwp) {
+         break;
+      }
+      zf->dwp = max(zf->dwp, ext->end);
+      list_del(&ext->list);
+      kfree(ext);
+   }
+}
+
+/*
+ * Completion of a tracked write: commit it to the durable WP, or on
+ * failure queue the roll back of the submitted WP.
+ */
+static void smrsim_flight_end(struct smrsim_bio *sb,
+                              int error)
+{
+   struct smrsim_flight      *fl;
+   struct smrsim_zone_flight *zf;
+   spinlock_t                *fk = &smrsim_flock[sb->zone_idx % SMR_ZONE_LOCK_NUM];
+   unsigned long              flags;
+
+   rcu_read_lock();
+   fl = rcu_dereference(smrsim_flight);
+   if (!fl || (fl->epoch != sb->epoch)) {
+      rcu_read_unlock();
+      return;
+   }
+   zf = &fl->zones[sb->zone_idx];
+   spin_lock_irqsave(fk, flags);
+   zf->inflight--;
+   if ((sb->gen != zf->gen) && (sb->start >= zf->rollback)) {
+      goto out;
+   }
+   if (error) {
+      zf->gen++;
+      zf->rollback = sb->start;
+      zf->err_wp = min(zf->err_wp, sb->start);
+      smrsim_flight_drop(zf, sb->start);
+      goto out;
+   }
+   smrsim_flight_commit(zf, sb);
+   out:
+   spin_unlock_irqrestore(fk, flags);
+   rcu_read_unlock();
+}
+
+/*
+ * Durable WP of zone_idx whose submitted WP is swp.
+ */
+static __u32 smrsim_flight_durable(__u32 zone_idx,
+                                   __u32 swp,
+                                   __u32 *inflight)
+{
+   struct smrsim_flight      *fl = smrsim_flight_table();
+   struct smrsim_zone_flight *zf;
+   spinlock_t                *fk = &smrsim_flock[zone_idx % SMR_ZONE_LOCK_NUM];
+   unsigned long              flags;
+   __u32                      dwp = swp;
+
+   if (inflight) {
+      *inflight = 0;
+   }
+   if (!fl || zone_idx >= fl->num_zones) {
+      return dwp;
+   }
+   zf = &fl->zones[zone_idx];
+   spin_lock_irqsave(fk, flags);
+   if (zf->inflight || (zf->err_wp != SMR_WP_NONE)) {
+      dwp = min(zf->dwp, swp);
+   }
+   if (inflight) {
+      *inflight = zf->inflight;
+   }
+   spin_unlock_irqrestore(fk, flags);
+   return dwp;
+}
+
+/*
+ * Persist what a drive would report after a crash: the durable WP of
+ * zones sidx..eidx-1 with writes in flight. Caller folded the zone table
+ * into the image and holds smrsim_zone_lock exclusive.
+ */
+static void smrsim_flight_persist(__u32 sidx,
+                                  __u32 eidx)
+{
+   __u32 idx;
+
+   eidx = min(eidx, SMR_NUMZONES);
+   for (idx = sidx; idx < eidx; idx++) {
+      zone_status[idx].z_write_ptr_offset = smrsim_flight_durable(idx, zone_wp[idx], NULL);
+   }
+}
+
+/*
+ * Keep the pages of zones persisted behind their WP dirty, so they are
+ * written again once the writes in flight complete.
+ */
+static void smrsim_flight_mark_lagging(void)
+{
+   __u32 idx;
+
+   for (idx = 0; idx < SMR_NUMZONES; idx++) {
+      if (zone_status[idx].z_write_ptr_offset != zone_wp[idx]) {
+         smrsim_pstore_mark(&zone_status[idx], sizeof(struct smrsim_zone_status));
+      }
+   }
+}
+
+static void smrsim_dev_idle_init(void)
+{
+   trace_smrsim_gen_evt("dm-smrsim", "idle initialization");
+   smrsim_dev_idle_checkpoint = jiffies;
+   zone_state->stats.dev_stats.idle_stats.dev_idle_time_max = 0;
+   zone_state->stats.dev_stats.idle_stats.dev_idle_time_min = jiffies / HZ;
+}
+
+static void smrsim_init_zone_default(__u64 sizedev)
+{
+   trace_smrsim_gen_evt("dm-smrsim", "zone default initialization");
+   SMR_CAPACITY = sizedev;
+   SMR_ZONE_SIZE_SHIFT = SMR_ZONE_SIZE_SHIFT_DEFAULT;
+   SMR_BLOCK_SIZE_SHIFT = SMR_BLOCK_SIZE_SHIFT_DEFAULT;
+   SMR_NUMZONES = (SMR_CAPACITY >> SMR_BLOCK_SIZE_SHIFT) 
+                                >> SMR_ZONE_SIZE_SHIFT;
+   SMR_NUMZONES_DEFAULT = SMR_NUMZONES;
+   printk(KERN_INFO "smrsim_init_zone_state: numzones=%d sizedev=%llu\n",
+      SMR_NUMZONES, sizedev);
+} 
+
+/*
+ * Swap in the zone map of a new table. Pages of the retired one stay
+ * alive while userspace still maps them.
+ */
+static void smrsim_zmap_swap(struct smrsim_zmap_hdr *zmap)
+{
+   struct smrsim_zmap_hdr *old;
+
+   mutex_lock(&smrsim_zmap_lock);
+   old = zone_zmap;
+   zone_zmap = zmap;
+   mutex_unlock(&smrsim_zmap_lock);
+   if (old) {
+      ACCESS_ONCE(old->retired) = 1;
+      vfree(old);
+   }
+}
+
+static void smrsim_zone_tbl_free(void)
+{
+   struct smrsim_zone_tbl *zt = rcu_dereference_protected(zone_tbl, 1);
+
+   rcu_assign_pointer(zone_tbl, NULL);
+   smrsim_zmap_swap(NULL);
+   if (!zt) {
+      return;
+   }
+   synchronize_rcu();
+   vfree(zt);
+}
+
+/*
+ * Take the table away from lockless reads, which then fall back to the
+ * locked path, and hand it to smrsim_zone_tbl_setup() to replace. Lets
+ * the zone geometry change in a short smrsim_conf_seq write section
+ * while the new table is built outside of it.
+ */
+static struct smrsim_zone_tbl *smrsim_zone_tbl_unpublish(void)
+{
+   struct smrsim_zone_tbl *zt = rcu_dereference_protected(zone_tbl, 1);
+
+   rcu_assign_pointer(zone_tbl, NULL);
+   return zt;
+}
+
+/*
+ * Build the table from the image in zone_status[] and publish it in
+ * place of old, which is put back if there is no memory. Caller holds
+ * smrsim_zone_lock exclusive, or runs in the constructor.
+ */
+static int smrsim_zone_tbl_setup(struct smrsim_zone_tbl *old)
+{
+   struct smrsim_zone_tbl *zt;
+   __u32 num_zones = max(SMR_NUMZONES, SMR_NUMZONES_DEFAULT);
+   __u32 map_longs = BITS_TO_LONGS(num_zones);
+   __u32 zmap_pages = DIV_ROUND_UP(num_zones, SMRSIM_ZMAP_ENTS);
+   struct smrsim_zmap_page *zpg;
+   __u32 idx;
+
+   zt = vzalloc(sizeof(struct smrsim_zone_tbl) +
+                (SMR_ZONE_CONDS + SMR_ZONE_BUCKETS) * map_longs * sizeof(unsigned long) +
+                num_zones * (sizeof(__u32) + 3 * sizeof(__u8)));
+   if (!zt) {
+      printk(KERN_ERR "smrsim: no enough memory for the zone table\n");
+      if (!old || (old->num_zones < SMR_NUMZONES)) {
+         SMR_NUMZONES = 0;
+      }
+      rcu_assign_pointer(zone_tbl, old);
+      return -ENOMEM;
+   }
+   zt->zmap = vmalloc_user((1 + zmap_pages) * SMRSIM_ZMAP_PAGE);
+   if (!zt->zmap) {
+      printk(KERN_ERR "smrsim: no zone map, /dev/smrsim_zones is unavailable\n");
+   } else {
+      zt->zmap->magic        = SMRSIM_ZMAP_MAGIC;
+      zt->zmap->version      = SMRSIM_ZMAP_VERSION;
+      zt->zmap->num_zones    = SMR_NUMZONES;
+      zt->zmap->zone_sectors = num_sectors_zone();
+      zt->zmap->pages        = zmap_pages;
+   }
+   zt->num_zones = num_zones;
+   for (idx = 0; idx < SMR_ZONE_CONDS; idx++) {
+      zt->cmap[idx] = (unsigned long *)(zt + 1) + idx * map_longs;
+   }
+   for (idx = 0; idx < SMR_ZONE_BUCKETS; idx++) {
+      zt->fmap[idx] = zt->cmap[0] + (SMR_ZONE_CONDS + idx) * map_longs;
+   }
+   zt->wp   = (__u32 *)(zt->cmap[0] + (SMR_ZONE_CONDS + SMR_ZONE_BUCKETS) * map_longs);
+   zt->cond = (__u8 *)(zt->wp + num_zones);
+   zt->type = zt->cond + num_zones;
+   zt->flag = zt->type + num_zones;
+   for (idx = 0; idx < SMR_NUMZONES; idx++) {
+      zt->wp[idx]   = zone_status[idx].z_write_ptr_offset;
+      zt->cond[idx] = zone_status[idx].z_conds;
+      zt->type[idx] = zone_status[idx].z_type;
+      zt->flag[idx] = zone_status[idx].z_flag;
+      __set_bit(idx, zt->cmap[zt->cond[idx] & (SMR_ZONE_CONDS - 1)]);
+      __set_bit(idx, zt->fmap[smrsim_zone_bucket(zt->wp[idx])]);
+      if (zt->zmap) {
+         zpg = (struct smrsim_zmap_page *)((char *)zt->zmap + SMRSIM_ZMAP_PAGE);
+         zpg[idx / SMRSIM_ZMAP_ENTS].ent[idx % SMRSIM_ZMAP_ENTS] =
+            SMRSIM_ZMAP_ENT(zt->wp[idx], zt->cond[idx], zt->type[idx]);
+      }
+   }
+   zone_wp   = zt->wp;
+   zone_cond = zt->cond;
+   zone_type = zt->type;
+   zone_flag = zt->flag;
+   zone_cmap = zt->cmap;
+   zone_fmap = zt->fmap;
+   smrsim_zmap_swap(zt->zmap);
+   rcu_assign_pointer(zone_tbl, zt);
+   if (old) {
+      synchronize_rcu();
+      vfree(old);
+   }
+   return 0;
+}
+
+/*
+ * Write the zone table back into the image for zones sidx..eidx-1.
+ * Caller holds smrsim_zone_lock exclusive.
+ */
+static void smrsim_zone_fold(__u32 sidx,
+                             __u32 eidx)
+{
+   __u32 idx;
+
+   eidx = min(eidx, SMR_NUMZONES);
+   for (idx = sidx; idx < eidx; idx++) {
+      zone_status[idx].z_write_ptr_offset = zone_wp[idx];
+      zone_status[idx].z_conds = zone_cond[idx];
+      zone_status[idx].z_type  = zone_type[idx];
+      zone_status[idx].z_flag  = zone_flag[idx];
+   }
+}
+
+static void smrsim_init_zone_status(void)
+{
+   __u32 i;
+
+   for(i=0; i< SMR_NUMZONES; i++)
+   {
+      zone_status[i].z_start = i;
+      zone_status[i].z_length = num_sectors_zone();
+      zone_status[i].z_write_ptr_offset = 0;
+      zone_status[i].z_checkpoint_offset = 0;
+      zone_status[i].z_type  =
+         (SMR_NUMZONES > 1) && (!i || (SMR_NUMZONES-1) == i) ?
+         Z_TYPE_CONVENTIONAL : Z_TYPE_SEQUENTIAL;
+      zone_status[i].z_conds = 
+         (SMR_NUMZONES > 1) && (!i || (SMR_NUMZONES-1) == i) ?
+         Z_COND_NO_WP : Z_COND_EMPTY;
+      zone_status[i].z_flag = 0;
+   }
+}
+
+static void smrsim_init_zone_state_default(__u32 state_size,
+                                           struct smrsim_zone_tbl *old)
+{
+   __u32 *magic;
+
+   zone_state->header.magic = 0xBEEFBEEF;
+   zone_state->header.length = state_size;
+   zone_state->header.version = VERSION;
+   zone_state->header.crc32 = 0;
+   zone_state->config.dev_config.out_of_policy_read_flag  = 0;
+   zone_state->config.dev_config.out_of_policy_write_flag = 0;
+   zone_state->config.dev_config.r_time_to_rmw_zone = 
+                                 SMR_OUT_OF_POLICY_PENALTY;
+   zone_state->config.dev_config.w_time_to_rmw_zone = 
+                                 SMR_OUT_OF_POLICY_PENALTY;
+   zone_state->stats.num_zones = SMR_NUMZONES;
+   smrsim_reset_stats();
+   zone_status =(struct smrsim_zone_status *)
+                 &zone_state->stats.zone_stats[SMR_NUMZONES];  
+   smrsim_init_zone_status();
+   magic = (__u32 *)&zone_status[SMR_NUMZONES]; 
+   *magic = 0xBEEFBEEF;
+   smrsim_zone_tbl_setup(old);
+   smrsim_pstore_dirty_setup();
+   smrsim_stat_setup();
+   smrsim_flight_setup();
+}
+
+int smrsim_init_zone_state(__u64 sizedev)
+{
+   __u32 state_size;
+
+   if (!sizedev) {
+      printk(KERN_ERR "smrsim: zero capacity detected\n");
+      return -EINVAL;
+   }
+   smrsim_init_zone_default(sizedev);
+   if (zone_state) {
+      vfree(zone_state);
+   }
+   state_size = smrsim_state_size();
+   zone_state = vzalloc(state_size); 
+   if (!zone_state) {
+      printk(KERN_ERR "smrsim: memory alloc failed for zone state\n");
+      return -ENOMEM;
+   }
+   smrsim_init_zone_state_default(state_size, smrsim_zone_tbl_unpublish());
+   smrsim_dev_idle_init();
+   trace_smrsim_gen_evt("dm-smrsim", "zone initialized");
+   return 0;
+}
+
+#ifdef SMRSIM_BLK_ZONED
+static void smrsim_pstore_end_io(struct bio *bio)
+{
+   int err = blk_status_to_errno(bio->bi_status);
+#else
+static void smrsim_pstore_end_io(struct bio *bio,
+                                 int err)
+{
+#endif
+   if (err) {
+      printk(KERN_ERR "smrsim: pstore bio err: %d\n", err);
+      smrsim_ptask.io_err = err;
+   }
+   if (atomic_dec_and_test(&smrsim_ptask.io_pending)) {
+      complete(&smrsim_ptask.io_event);
+   }
+   bio_put(bio);
+}
+
+static void smrsim_pstore_start(void)
+{
+   init_completion(&smrsim_ptask.io_event);
+   atomic_set(&smrsim_ptask.io_pending, 1);
+   smrsim_ptask.io_err = 0;
+}
+
+/*
+ * Queue the IO of npages pages at addr, vmalloc'd or not, to or from
+ * sector lba, as few bios as the queue allows; rw is a SMRSIM_IO_*.
+ * Nothing is waited for until smrsim_pstore_wait().
+ */
+static int smrsim_pstore_submit(struct block_device *dev,
+                                unsigned int rw,
+                                void *addr,
+                                sector_t lba,
+                                __u32 npages)
+{
+   unsigned char *buf = addr;
+   struct bio    *bio;
+   struct page   *page;
+   __u32          nr;
+   __u32          idx;
+
+   if (npages && smrsim_bio_is_write(rw) && is_vmalloc_addr(addr)) {
+      flush_kernel_vmap_range(addr, npages * PAGE_SIZE);
+   }
+   while (npages) {
+      nr = min_t(__u32, npages, SMRSIM_BIO_MAX_PAGES);
+      #if defined(SMRSIM_BLK_ZONED) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+      bio = bio_alloc(dev, nr, rw, GFP_NOIO);
+      #else
+      bio = bio_alloc(GFP_NOIO, nr);
+      #endif
+      if (!bio) {
+         printk(KERN_ERR "smrsim: %s bio_alloc failed\n", __FUNCTION__);
+         return -ENOMEM;
+      }
+      smrsim_bio_set_dev(bio, dev);
+      #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+      bio->bi_sector = lba;
+      #else
+      bio->bi_iter.bi_sector = lba;
+      #endif
+      bio->bi_end_io = smrsim_pstore_end_io;
+      for (idx = 0; idx < nr; idx++, buf += PAGE_SIZE) {
+         page = is_vmalloc_addr(buf) ? vmalloc_to_page(buf) : virt_to_page(buf);
+         if (bio_add_page(bio, page, PAGE_SIZE, 0) < PAGE_SIZE) {
+            break;
+         }
+      }
+      if (!idx) {
+         printk(KERN_ERR "smrsim: %s can't add a page to the bio\n", __FUNCTION__);
+         bio_put(bio);
+         return -EIO;
+      }
+      atomic_inc(&smrsim_ptask.io_pending);
+      smrsim_bio_submit_rw(bio, rw);
+      lba    += idx << SMR_PAGE_SIZE_SHIFT_DEFAULT;
+      npages -= idx;
+   }
+   return 0;
+}
+
+static int smrsim_pstore_wait(void)
+{
+   if (!atomic_dec_and_test(&smrsim_ptask.io_pending)) {
+      wait_for_completion(&smrsim_ptask.io_event);
+   }
+   if (smrsim_ptask.io_err) {
+      printk(KERN_ERR "smrsim: pstore bio failed\n");
+      return -EIO;
+   }
+   return 0;
+}
+
+/*
+ * Metadata lives on the meta device from sector 0 if one was given,
+ * else on the data device past the last zone.
+ */
+static struct block_device *smrsim_pstore_bdev(struct dm_target *ti)
+{
+   struct smrsim_c *c = ti->private;
+
+   return c->meta_dev ? c->meta_dev->bdev : c->dev->bdev;
+}
+
+static sector_t smrsim_pstore_slot_lba(__u8 slot)
+{
+   return smrsim_ptask.pstore_lba +
+          ((sector_t)slot * SMR_PSTORE_SLOT >> SMR_SECTOR_SIZE_SHIFT_DEFAULT);
+}
+
+static void smrsim_pstore_stage_free(void)
+{
+   vfree(smrsim_ptask.stage);
+   kfree(smrsim_ptask.stage_map);
+   kfree(smrsim_ptask.pcrc);
+   vfree(smrsim_ptask.cbuf);
+   smrsim_ptask.stage = NULL;
+   smrsim_ptask.stage_map = NULL;
+   smrsim_ptask.prev_map = NULL;
+   smrsim_ptask.pcrc = NULL;
+   smrsim_ptask.cbuf = NULL;
+   smrsim_ptask.stage_pages = 0;
+}
+
+/*
+ * (Re)size the mirror of the image and its page maps. Called by the task
+ * with smrsim_zone_lock exclusive, or from the constructor.
+ */
+static int smrsim_pstore_stage_setup(__u32 num_pages)
+{
+   __u32 map_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+   /* zones the image has room for, stats.num_zones grows back to it */
+   __u32 num_zones = (zone_state->header.length -
+                      offsetof(struct smrsim_state, stats.zone_stats)) /
+                     (sizeof(struct smrsim_zone_stats) + sizeof(struct smrsim_zone_status));
+
+   smrsim_pstore_stage_free();
+   smrsim_ptask.stage_compact = (num_pages > SMR_PSTORE_PAGES) ||
+      (smrsim_ptask.compact &&
+       (smrsim_pstore_compact_max(num_zones) <= SMR_PSTORE_PAGES * PAGE_SIZE));
+   smrsim_ptask.stage = vzalloc(num_pages * PAGE_SIZE);
+   smrsim_ptask.stage_map = kzalloc(2 * map_size, GFP_KERNEL);
+   smrsim_ptask.pcrc = kcalloc(SMR_PSTORE_PAGES, sizeof(__u32), GFP_KERNEL);
+   if (smrsim_ptask.stage_compact) {
+      smrsim_ptask.cbuf = vzalloc(SMR_PSTORE_PAGES * PAGE_SIZE);
+   }
+   if (!smrsim_ptask.stage || !smrsim_ptask.stage_map || !smrsim_ptask.pcrc ||
+       (smrsim_ptask.stage_compact && !smrsim_ptask.cbuf)) {
+      printk(KERN_ERR "smrsim: no enough memory for the persistence stage\n");
+      smrsim_pstore_stage_free();
+      return -ENOMEM;
+   }
+   smrsim_ptask.prev_map = smrsim_ptask.stage_map + map_size / sizeof(unsigned long);
+   smrsim_ptask.stage_pages = num_pages;
+   return 0;
+}
+
+/*
+ * Zones sidx..eidx-1 of the table at tbl, entries of size bytes, start
+ * on page pg of the image. The last one may run into the next page,
+ * which is marked to be written along.
+ */
+static void smrsim_pstore_span(void *tbl,
+                               size_t size,
+                               __u32 pg,
+                               __u32 *sidx,
+                               __u32 *eidx)
+{
+   unsigned long base = (unsigned char *)tbl - (unsigned char *)zone_state;
+   unsigned long lo   = (unsigned long)pg * PAGE_SIZE;
+   unsigned long hi   = lo + PAGE_SIZE;
+
+   *sidx = min_t(unsigned long, lo > base ? DIV_ROUND_UP(lo - base, size) : 0, SMR_NUMZONES);
+   *eidx = min_t(unsigned long, hi > base ? DIV_ROUND_UP(hi - base, size) : 0, SMR_NUMZONES);
+   if ((*eidx > *sidx) && ((base + *eidx * size) > hi)) {
+      smrsim_pstore_mark((unsigned char *)zone_state + hi, 1);
+   }
+}
+
+/*
+ * Fold the image and copy what the next slot is missing into the stage;
+ * stage_map gets the pages to write. Only the zones on dirty pages are
+ * folded, so the rest of the image still matches the stage. Caller holds
+ * smrsim_zone_lock exclusive. Returns the slot to write.
+ */
+static int smrsim_pstore_snapshot(bool full)
+{
+   unsigned long *dirty = smrsim_ptask.dirty;
+   __u32          num_pages = DIV_ROUND_UP(zone_state->header.length, PAGE_SIZE);
+   __u32          pg;
+   __u32          end;
+   __u32          sidx;
+   __u32          eidx;
+
+   if (num_pages != smrsim_ptask.stage_pages) {
+      if (smrsim_pstore_stage_setup(num_pages)) {
+         return -ENOMEM;
+      }
+      full = true;
+   }
+   if (full || !dirty || smrsim_ptask.dirty_all) {
+      if (dirty) {
+         bitmap_zero(dirty, smrsim_ptask.num_pages);
+      }
+      smrsim_ptask.dirty_all = false;
+      smrsim_stat_fold(0, SMR_NUMZONES);
+      smrsim_zone_fold(0, SMR_NUMZONES);
+      smrsim_flight_persist(0, SMR_NUMZONES);
+      memcpy(smrsim_ptask.stage, zone_state, zone_state->header.length);
+      bitmap_fill(smrsim_ptask.stage_map, num_pages);
+      bitmap_fill(smrsim_ptask.prev_map, num_pages);
+   } else {
+      set_bit(0, dirty);
+      for_each_set_bit(pg, dirty, num_pages) {
+         smrsim_pstore_span(zone_state->stats.zone_stats, sizeof(struct smrsim_zone_stats),
+                            pg, &sidx, &eidx);
+         smrsim_stat_fold(sidx, eidx);
+         smrsim_pstore_span(zone_status, sizeof(struct smrsim_zone_status),
+                            pg, &sidx, &eidx);
+         smrsim_zone_fold(sidx, eidx);
+         smrsim_flight_persist(sidx, eidx);
+      }
+      for (pg = find_first_bit(dirty, num_pages); pg < num_pages;
+           pg = find_next_bit(dirty, num_pages, end)) {
+         end = find_next_zero_bit(dirty, num_pages, pg);
+         memcpy((unsigned char *)smrsim_ptask.stage + pg * PAGE_SIZE,
+                (unsigned char *)zone_state + pg * PAGE_SIZE,
+                min_t(__u32, end * PAGE_SIZE, zone_state->header.length) - pg * PAGE_SIZE);
+      }
+      bitmap_or(smrsim_ptask.stage_map, dirty, smrsim_ptask.prev_map, num_pages);
+      bitmap_copy(smrsim_ptask.prev_map, dirty, num_pages);
+      bitmap_zero(dirty, num_pages);
+   }
+   smrsim_pstore_clean();
+   smrsim_flight_mark_lagging();
+   return smrsim_ptask.slot;
+}
+
+/*
+ * Compact image coding, on a cursor that stops at end.
+ */
+struct smrsim_pc {
+   unsigned char *p;
+   unsigned char *end;
+   bool           err;
+};
+
+static void smrsim_pc_byte(struct smrsim_pc *pc,
+                           __u8 v)
+{
+   if (pc->p >= pc->end) {
+      pc->err = true;
+      return;
+   }
+   *pc->p++ = v;
+}
+
+static void smrsim_pc_put(struct smrsim_pc *pc,
+                          __u64 v)
+{
+   while (v >= 0x80) {
+      smrsim_pc_byte(pc, (__u8)(v | 0x80));
+      v >>= 7;
+   }
+   smrsim_pc_byte(pc, (__u8)v);
+}
+
+static __u8 smrsim_pc_get_byte(struct smrsim_pc *pc)
+{
+   if (pc->p >= pc->end) {
+      pc->err = true;
+      return 0;
+   }
+   return *pc->p++;
+}
+
+static __u64 smrsim_pc_get(struct smrsim_pc *pc)
+{
+   __u64 v = 0;
+   __u8  b;
+   int   shift;
+
+   for (shift = 0; shift < 64; shift += 7) {
+      b = smrsim_pc_get_byte(pc);
+      v |= (__u64)(b & 0x7F) << shift;
+      if (!(b & 0x80)) {
+         return v;
+      }
+   }
+   pc->err = true;
+   return 0;
+}
+
+static __u8 smrsim_pc_kind(struct smrsim_zone_status *zs,
+                           __u32 idx)
+{
+   if ((zs->z_start != idx) || zs->z_checkpoint_offset) {
+      return SMR_PC_RAW | SMR_PC_LIST;
+   }
+   if (!zs->z_write_ptr_offset) {
+      return SMR_PC_ZERO;
+   }
+   if (zs->z_write_ptr_offset == zs->z_length) {
+      return SMR_PC_FULL;
+   }
+   return SMR_PC_LIST;
+}
+
+/*
+ * Encode the image st into buf of size bytes. Returns the bytes used, 0
+ * if it doesn't fit.
+ */
+static __u32 smrsim_pstore_encode(struct smrsim_state *st,
+                                  unsigned char *buf,
+                                  __u32 size)
+{
+   struct smrsim_pstore_chdr *ch = (struct smrsim_pstore_chdr *)buf;
+   struct smrsim_zone_stats  *zst = st->stats.zone_stats;
+   struct smrsim_zone_status *zs;
+   struct smrsim_pc pc;
+   __u32 num_zones = st->stats.num_zones;
+   __u32 prefix = (unsigned char *)zst - (unsigned char *)st;
+   __u32 nr = 0;
+   __u32 prev;
+   __u32 wp;
+   __u32 idx;
+   __u32 end;
+   __u8  kind;
+
+   zs = (struct smrsim_zone_status *)&zst[num_zones];
+   if (size < sizeof(*ch) + prefix) {
+      return 0;
+   }
+   ch->magic     = SMR_PSTORE_CMAGIC;
+   ch->version   = SMR_PSTORE_CVERSION;
+   ch->length    = st->header.length;
+   ch->num_zones = num_zones;
+   memcpy(buf + sizeof(*ch), st, prefix);
+   pc.p   = buf + sizeof(*ch) + prefix;
+   pc.end = buf + size;
+   pc.err = false;
+   for (idx = 0; idx < num_zones; idx = end) {
+      kind = smrsim_pc_kind(&zs[idx], idx);
+      for (end = idx + 1; (end < num_zones) &&
+           (smrsim_pc_kind(&zs[end], end) == kind) &&
+           (zs[end].z_length == zs[idx].z_length) &&
+           (zs[end].z_conds == zs[idx].z_conds) &&
+           (zs[end].z_type == zs[idx].z_type) &&
+           (zs[end].z_flag == zs[idx].z_flag); end++);
+      smrsim_pc_put(&pc, end - idx);
+      smrsim_pc_byte(&pc, kind);
+      smrsim_pc_byte(&pc, zs[idx].z_type);
+      smrsim_pc_byte(&pc, zs[idx].z_flag);
+      smrsim_pc_put(&pc, zs[idx].z_conds);
+      smrsim_pc_put(&pc, zs[idx].z_length);
+      if (!(kind & SMR_PC_LIST)) {
+         continue;
+      }
+      for (prev = 0; idx < end; idx++) {
+         if (kind & SMR_PC_RAW) {
+            smrsim_pc_put(&pc, zs[idx].z_start);
+            smrsim_pc_put(&pc, zs[idx].z_checkpoint_offset);
+         }
+         wp = zs[idx].z_write_ptr_offset;
+         smrsim_pc_put(&pc, wp >= prev ? (__u64)(wp - prev) << 1 :
+                                         ((__u64)(prev - wp) << 1) - 1);
+         prev = wp;
+      }
+   }
+   for (idx = 0; idx < num_zones; idx++) {
+      nr += !!memchr_inv(&zst[idx], 0, sizeof(zst[idx]));
+   }
+   smrsim_pc_put(&pc, nr);
+   for (idx = 0, prev = 0; idx < num_zones; idx++) {
+      if (!memchr_inv(&zst[idx], 0, sizeof(zst[idx]))) {
+         continue;
+      }
+      smrsim_pc_put(&pc, idx - prev);
+      smrsim_pc_put(&pc, zst[idx].out_of_policy_read_stats.beyond_swp_count);
+      smrsim_pc_put(&pc, zst[idx].out_of_policy_read_stats.span_zones_count);
+      smrsim_pc_put(&pc, zst[idx].out_of_policy_write_stats.not_on_swp_count);
+      smrsim_pc_put(&pc, zst[idx].out_of_policy_write_stats.span_zones_count);
+      smrsim_pc_put(&pc, zst[idx].out_of_policy_write_stats.unaligned_count);
+      prev = idx + 1;
+   }
+   if (pc.err) {
+      return 0;
+   }
+   return pc.p - buf;
+}
+
+/*
+ * Decode bytes of compact image at buf into st, length bytes zeroed.
+ */
+static int smrsim_pstore_decode(unsigned char *buf,
+                                __u32 bytes,
+                                struct smrsim_state *st,
+                                __u32 length)
+{
+   struct smrsim_pstore_chdr *ch = (struct smrsim_pstore_chdr *)buf;
+   struct smrsim_zone_stats  *zst = st->stats.zone_stats;
+   struct smrsim_zone_status *zs;
+   struct smrsim_pc pc;
+   __u32 prefix = (unsigned char *)zst - (unsigned char *)st;
+   __u32 num_zones;
+   __u64 delta;
+   __u64 nr;
+   __u32 prev;
+   __u32 idx;
+   __u32 end;
+   __u8  kind;
+   __u8  type;
+   __u8  flag;
+   __u16 conds;
+   __u32 z_length;
+
+   if ((bytes < sizeof(*ch) + prefix) || (ch->magic != SMR_PSTORE_CMAGIC) ||
+       (ch->version != SMR_PSTORE_CVERSION) || (ch->length != length)) {
+      return -EINVAL;
+   }
+   num_zones = ch->num_zones;
+   if ((__u64)prefix + (__u64)num_zones * (sizeof(*zst) + sizeof(*zs)) + sizeof(__u32) !=
+       length) {
+      return -EINVAL;
+   }
+   memcpy(st, buf + sizeof(*ch), prefix);
+   if (st->stats.num_zones != num_zones) {
+      return -EINVAL;
+   }
+   zs = (struct smrsim_zone_status *)&zst[num_zones];
+   pc.p   = buf + sizeof(*ch) + prefix;
+   pc.end = buf + bytes;
+   pc.err = false;
+   for (idx = 0; !pc.err && (idx < num_zones); idx = end) {
+      nr       = smrsim_pc_get(&pc);
+      kind     = smrsim_pc_get_byte(&pc);
+      type     = smrsim_pc_get_byte(&pc);
+      flag     = smrsim_pc_get_byte(&pc);
+      conds    = smrsim_pc_get(&pc);
+      z_length = smrsim_pc_get(&pc);
+      if (!nr || (nr > num_zones - idx)) {
+         return -EINVAL;
+      }
+      end = idx + nr;
+      for (prev = 0; idx < end; idx++) {
+         zs[idx].z_start  = idx;
+         zs[idx].z_length = z_length;
+         zs[idx].z_conds  = conds;
+         zs[idx].z_type   = type;
+         zs[idx].z_flag   = flag;
+         if (kind & SMR_PC_RAW) {
+            zs[idx].z_start = smrsim_pc_get(&pc);
+            zs[idx].z_checkpoint_offset = smrsim_pc_get(&pc);
+         }
+         if (kind & SMR_PC_LIST) {
+            delta = smrsim_pc_get(&pc);
+            prev = (delta & 1) ? prev - (__u32)((delta + 1) >> 1) : prev + (__u32)(delta >> 1);
+            zs[idx].z_write_ptr_offset = prev;
+         } else if (kind & SMR_PC_FULL) {
+            zs[idx].z_write_ptr_offset = z_length;
+         }
+      }
+   }
+   nr = smrsim_pc_get(&pc);
+   for (idx = 0; !pc.err && nr--; idx++) {
+      idx += smrsim_pc_get(&pc);
+      if (idx >= num_zones) {
+         return -EINVAL;
+      }
+      zst[idx].out_of_policy_read_stats.beyond_swp_count = smrsim_pc_get(&pc);
+      zst[idx].out_of_policy_read_stats.span_zones_count = smrsim_pc_get(&pc);
+      zst[idx].out_of_policy_write_stats.not_on_swp_count = smrsim_pc_get(&pc);
+      zst[idx].out_of_policy_write_stats.span_zones_count = smrsim_pc_get(&pc);
+      zst[idx].out_of_policy_write_stats.unaligned_count = smrsim_pc_get(&pc);
+   }
+   if (pc.err) {
+      return -EINVAL;
    }
+   *(__u32 *)&zs[num_zones] = 0xBEEFBEEF;
+   return 0;
 }
 
-static void smrsim_init_zone_state_default(__u32 state_size)
+static __u32 smrsim_pstore_page_crc(void *img,
+                                    __u32 pg)
 {
-   __u32 *magic;
-
-   zone_state->header.magic = 0xBEEFBEEF;
-   zone_state->header.length = state_size;
-   zone_state->header.version = VERSION;
-   zone_state->header.crc32 = 0;
-   zone_state->config.dev_config.out_of_policy_read_flag  = 0;
-   zone_state->config.dev_config.out_of_policy_write_flag = 0;
-   zone_state->config.dev_config.r_time_to_rmw_zone = 
-                                 SMR_OUT_OF_POLICY_PENALTY;
-   zone_state->config.dev_config.w_time_to_rmw_zone = 
-                                 SMR_OUT_OF_POLICY_PENALTY;
-   zone_state->stats.num_zones = SMR_NUMZONES;
-   smrsim_reset_stats();
-   zone_status =(struct smrsim_zone_status *)
-                 &zone_state->stats.zone_stats[SMR_NUMZONES];  
-   smrsim_init_zone_status();
-   magic = (__u32 *)&zone_status[SMR_NUMZONES]; 
-   *magic = 0xBEEFBEEF;
+   return crc32(0, (unsigned char *)img + pg * PAGE_SIZE, PAGE_SIZE);
 }
 
-int smrsim_init_zone_state(__u64 sizedev)
+/*
+ * Write the staged pages to a slot, then its descriptor with the
+ * checkpoint's only flush/FUA. Only the written pages are hashed, the
+ * slot's other pages already match the stage. A compact image is
+ * encoded and written whole. Runs without smrsim_zone_lock.
+ */
+static int smrsim_pstore_write(struct block_device *dev,
+                               __u8 slot)
 {
-   __u32 state_size;
+   struct smrsim_pstore_desc *desc;
+   struct page *page;
+   sector_t     lba = smrsim_pstore_slot_lba(slot) + (1 << SMR_PAGE_SIZE_SHIFT_DEFAULT);
+   __u32        num_pages = smrsim_ptask.stage_pages;
+   __u32        length = smrsim_ptask.stage->header.length;
+   __u32        bytes = length;
+   __u32        pg;
+   __u32        end;
+   int          ret = 0;
+   int          err;
 
-   if (!sizedev) {
-      printk(KERN_ERR "smrsim: zero capacity detected\n");
-      return -EINVAL;
+   smrsim_pstore_start();
+   if (smrsim_ptask.stage_compact) {
+      bytes = smrsim_pstore_encode(smrsim_ptask.stage, smrsim_ptask.cbuf,
+                                   SMR_PSTORE_PAGES * PAGE_SIZE);
+      if (!bytes) {
+         printk(KERN_ERR "smrsim: compact metadata image exceeds the persistence slot\n");
+         smrsim_pstore_wait();
+         return -ENOSPC;
+      }
+      num_pages = DIV_ROUND_UP(bytes, PAGE_SIZE);
+      memset(smrsim_ptask.cbuf + bytes, 0, num_pages * PAGE_SIZE - bytes);
+      for (pg = 0; pg < num_pages; pg++) {
+         smrsim_ptask.pcrc[pg] = smrsim_pstore_page_crc(smrsim_ptask.cbuf, pg);
+      }
+      ret = smrsim_pstore_submit(dev, SMRSIM_IO_WRITE, smrsim_ptask.cbuf, lba, num_pages);
+   } else {
+      for_each_set_bit(pg, smrsim_ptask.stage_map, num_pages) {
+         smrsim_ptask.pcrc[pg] = smrsim_pstore_page_crc(smrsim_ptask.stage, pg);
+      }
    }
-   smrsim_init_zone_default(sizedev);
-   if (zone_state) {
-      vfree(zone_state);
+   for (pg = find_first_bit(smrsim_ptask.stage_map, num_pages);
+        !smrsim_ptask.stage_compact && !ret && (pg < num_pages);
+        pg = find_next_bit(smrsim_ptask.stage_map, num_pages, end)) {
+      end = find_next_zero_bit(smrsim_ptask.stage_map, num_pages, pg);
+      ret = smrsim_pstore_submit(dev, SMRSIM_IO_WRITE, (unsigned char *)smrsim_ptask.stage + pg * PAGE_SIZE,
+                                 lba + (pg << SMR_PAGE_SIZE_SHIFT_DEFAULT), end - pg);
    }
-   state_size = smrsim_state_size();
-   zone_state = vzalloc(state_size); 
-   if (!zone_state) {
-      printk(KERN_ERR "smrsim: memory alloc failed for zone state\n");
+   err = smrsim_pstore_wait();
+   if (ret || err) {
+      return ret ? ret : err;
+   }
+   page = alloc_pages(GFP_KERNEL, 0);
+   if (!page) {
+      printk(KERN_ERR "smrsim: no enough memory to allocate a page\n");
       return -ENOMEM;
    }
-   smrsim_init_zone_state_default(state_size);
-   smrsim_dev_idle_init();
-   trace_smrsim_gen_evt("dm-smrsim", "zone initialized");
-   return 0;
+   desc = page_address(page);
+   memset(desc, 0, PAGE_SIZE);
+   desc->magic  = SMR_PSTORE_MAGIC;
+   desc->length = length;
+   desc->seq    = ++smrsim_ptask.seq;
+   desc->format = smrsim_ptask.stage_compact ? SMR_PSTORE_FMT_COMPACT : SMR_PSTORE_FMT_RAW;
+   desc->bytes  = bytes;
+   memcpy(desc->pcrc, smrsim_ptask.pcrc, num_pages * sizeof(__u32));
+   desc->crc32  = crc32(0, (unsigned char *)desc->pcrc, num_pages * sizeof(__u32));
+   smrsim_pstore_start();
+   ret = smrsim_pstore_submit(dev, SMRSIM_IO_WRITE_FLUSH, desc, smrsim_pstore_slot_lba(slot), 1);
+   err = smrsim_pstore_wait();
+   __free_pages(page, 0);
+   return ret ? ret : err;
 }
 
-static void smrsim_read_complete(struct bio *bio,
-                                 int err)
+static sector_t smrsim_pstore_log_lba(void)
 {
-   if (err) {
-      printk(KERN_ERR "smrsim: bio read err: %d\n", err);
+   return smrsim_pstore_slot_lba(SMR_PSTORE_SLOTS);
+}
+
+/*
+ * Append a record per zone in zmap to the log mirror, from page log_head
+ * on. A pass is staged whole or not at all, so a write spanning zones
+ * can't be replayed for some of them only: when the zones don't fit the
+ * pass is left to a checkpoint. Zones whose writes are still in flight
+ * stay in zmap. Caller holds smrsim_zone_lock exclusive. Returns the
+ * number of pages staged.
+ */
+static __u32 smrsim_pstore_log_stage(void)
+{
+   struct smrsim_pstore_logpg *lp = NULL;
+   struct smrsim_pstore_rec   *rec;
+   __u32 max_pages = SMR_PSTORE_LOG / PAGE_SIZE;
+   __u32 pg = smrsim_ptask.log_head;
+   __u32 idx;
+
+   smrsim_pstore_clean();
+   if (pg + DIV_ROUND_UP(bitmap_weight(smrsim_ptask.zmap, smrsim_ptask.zmap_zones),
+                         ARRAY_SIZE(lp->rec)) > max_pages) {
+      smrsim_ptask.dirty_all = true;
+      smrsim_ptask.dirty_since = jiffies | 1;
+      return 0;
+   }
+   for_each_set_bit(idx, smrsim_ptask.zmap, smrsim_ptask.zmap_zones) {
+      if (idx >= SMR_NUMZONES) {
+         clear_bit(idx, smrsim_ptask.zmap);
+         continue;
+      }
+      if (!lp || (lp->nr == ARRAY_SIZE(lp->rec))) {
+         if (pg == max_pages) {
+            break;
+         }
+         lp = (struct smrsim_pstore_logpg *)((unsigned char *)smrsim_ptask.log + pg * PAGE_SIZE);
+         memset(lp, 0, PAGE_SIZE);
+         lp->magic = SMR_PSTORE_LOG_MAGIC;
+         lp->epoch = smrsim_ptask.epoch;
+         lp->page  = pg++;
+      }
+      rec = &lp->rec[lp->nr++];
+      rec->zone_idx = idx;
+      rec->wp   = smrsim_flight_durable(idx, zone_wp[idx], NULL);
+      rec->cond = zone_cond[idx];
+      rec->seq  = ++smrsim_ptask.log_rec;
+      if (rec->wp == zone_wp[idx]) {
+         clear_bit(idx, smrsim_ptask.zmap);
+      }
    }
-   if (bio) {
-      complete((struct completion *)bio->bi_private);
+   if (find_first_bit(smrsim_ptask.zmap, smrsim_ptask.zmap_zones) < smrsim_ptask.zmap_zones) {
+      smrsim_ptask.dirty_since = jiffies | 1;
    }
+   return pg - smrsim_ptask.log_head;
 }
 
-static void smrsim_write_complete(struct bio *bio,
-                                  int err)
+/*
+ * Write the npages staged at log_head. Runs without smrsim_zone_lock.
+ */
+static int smrsim_pstore_log_write(struct block_device *dev,
+                                   __u32 npages)
 {
-   if (err) {
-      printk(KERN_ERR "smrsim: bio write err: %d\n", err);
+   struct smrsim_pstore_logpg *lp;
+   __u32 pg;
+   int   ret;
+   int   err;
+
+   for (pg = smrsim_ptask.log_head; pg < smrsim_ptask.log_head + npages; pg++) {
+      lp = (struct smrsim_pstore_logpg *)((unsigned char *)smrsim_ptask.log + pg * PAGE_SIZE);
+      lp->crc32 = crc32(0, (unsigned char *)&lp->epoch,
+                        PAGE_SIZE - offsetof(struct smrsim_pstore_logpg, epoch));
    }
-   if (bio) {
-      complete((struct completion *)bio->bi_private);
+   smrsim_pstore_start();
+   ret = smrsim_pstore_submit(dev, SMRSIM_IO_WRITE_FUA,
+                              (unsigned char *)smrsim_ptask.log +
+                              smrsim_ptask.log_head * PAGE_SIZE,
+                              smrsim_pstore_log_lba() +
+                              (smrsim_ptask.log_head << SMR_PAGE_SIZE_SHIFT_DEFAULT),
+                              npages);
+   err = smrsim_pstore_wait();
+   if (ret || err) {
+      printk(KERN_ERR "smrsim: journal append failed\n");
+      smrsim_ptask.dirty_all = true;
+      return ret ? ret : err;
    }
+   smrsim_ptask.log_head += npages;
+   return 0;
+}
+
+/*
+ * Append the zones changed since the last pass to the journal.
+ */
+static int smrsim_pstore_append(struct dm_target* ti)
+{
+   __u32 npages;
 
+   down_write(&smrsim_zone_lock);
+   npages = smrsim_pstore_log_stage();
+   up_write(&smrsim_zone_lock);
+   if (!npages) {
+      return 0;
+   }
+   return smrsim_pstore_log_write(smrsim_pstore_bdev(ti), npages);
 }
 
-static int smrsim_read_page(struct block_device *dev, 
-                            sector_t lba, 
-                            int size, 
-                            struct page *page)
+/*
+ * Apply the log of epoch, read into log, onto the image just loaded.
+ * Returns the number of log pages replayed.
+ */
+static __u32 smrsim_pstore_replay(struct smrsim_pstore_logpg *log,
+                                  __u64 epoch)
 {
-    int ret = 0;
-    struct bio *bio = bio_alloc(GFP_NOIO, 1);
+   struct smrsim_pstore_logpg *lp;
+   struct smrsim_pstore_rec   *rec;
+   __u32 max_pages = SMR_PSTORE_LOG / PAGE_SIZE;
+   __u32 pg;
+   __u32 idx;
 
-    if (!bio) {
-       printk(KERN_ERR "smrsim: %s bio_alloc failed\n", __FUNCTION__);
-       return -EFAULT; 
-    }
-    bio->bi_bdev = dev;
-    #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-    bio->bi_sector = lba;
-    #else
-    bio->bi_iter.bi_sector = lba;
-    #endif
-    bio_add_page(bio, page, size, 0);
-    bio->bi_private = &smrsim_ptask.read_event;
-    bio->bi_end_io = smrsim_read_complete;
-    submit_bio(READ | REQ_SYNC, bio);
-    wait_for_completion(&smrsim_ptask.read_event);
-    ret = test_bit(BIO_UPTODATE, &bio->bi_flags);
-    if (!ret) {
-       printk(KERN_ERR "smrsim: pstore bio read failed");
-       ret = -EIO;
-    }
-    bio_put(bio);
-    return ret;
+   smrsim_ptask.log_rec = 0;
+   for (pg = 0; pg < max_pages; pg++) {
+      lp = (struct smrsim_pstore_logpg *)((unsigned char *)log + pg * PAGE_SIZE);
+      if ((lp->magic != SMR_PSTORE_LOG_MAGIC) || (lp->epoch != epoch) ||
+          (lp->page != pg) || (lp->nr > ARRAY_SIZE(lp->rec)) ||
+          (lp->crc32 != crc32(0, (unsigned char *)&lp->epoch,
+                              PAGE_SIZE - offsetof(struct smrsim_pstore_logpg, epoch)))) {
+         break;
+      }
+      for (idx = 0; idx < lp->nr; idx++) {
+         rec = &lp->rec[idx];
+         if (rec->seq != smrsim_ptask.log_rec + 1) {
+            break;
+         }
+         smrsim_ptask.log_rec = rec->seq;
+         if (rec->zone_idx < SMR_NUMZONES) {
+            zone_status[rec->zone_idx].z_write_ptr_offset = rec->wp;
+            zone_status[rec->zone_idx].z_conds = rec->cond;
+         }
+      }
+      if (idx < lp->nr) {
+         break;
+      }
+   }
+   if (pg) {
+      printk(KERN_INFO "smrsim: replayed %u journal records\n", smrsim_ptask.log_rec);
+   }
+   return pg;
 }
 
-static int smrsim_write_page(struct block_device *dev,
-                             sector_t lba, 
-                             __u32 size, 
-                             struct page *page)
+/*
+ * Take a checkpoint: the whole image if full, else the dirty pages.
+ * smrsim_zone_lock is held only for the snapshot. A failed slot is
+ * written again, in full, by the next checkpoint; the other one keeps
+ * the last good image meanwhile. In journal mode the pending records
+ * are appended first, so that image and its log stay complete until
+ * the new one commits.
+ */
+static int smrsim_pstore_checkpoint(struct dm_target* ti,
+                                    bool full)
 {
-    int ret = 0;
-    struct bio *bio = bio_alloc(GFP_NOIO, 1);
+   struct block_device *dev = smrsim_pstore_bdev(ti);
+   __u32 npages = 0;
+   int slot;
+   int ret;
 
-    if (!bio) {
-       printk(KERN_ERR "smrsim: %s bio_alloc failed\n", __FUNCTION__);
-       return -EFAULT; 
-    }
-    bio->bi_bdev = dev;
-    #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-    bio->bi_sector = lba;
-    #else
-    bio->bi_iter.bi_sector = lba;
-    #endif
-    bio_add_page(bio, page, size, 0);
-    bio->bi_private = &smrsim_ptask.write_event;
-    bio->bi_end_io = smrsim_write_complete;
-    submit_bio(WRITE_FLUSH_FUA, bio);
-    wait_for_completion(&smrsim_ptask.write_event);
-    ret = test_bit(BIO_UPTODATE, &bio->bi_flags);
-    if (!ret) {
-       printk(KERN_ERR "smrsim: pstore bio write failed");
-       ret = -EIO;
-    }
-    bio_put(bio);
-    return ret;
+   down_write(&smrsim_zone_lock);
+   if (full && !SMR_NUMZONES) {
+      smrsim_ptask.flag = SMR_NO_CHANGE;
+      up_write(&smrsim_zone_lock);
+      return 0;
+   }
+   if (smrsim_pstore_journal()) {
+      npages = smrsim_pstore_log_stage();
+   }
+   slot = smrsim_pstore_snapshot(full);
+   smrsim_ptask.flag = SMR_NO_CHANGE;
+   up_write(&smrsim_zone_lock);
+   if (npages) {
+      smrsim_pstore_log_write(dev, npages);
+   }
+   if (slot < 0) {
+      return slot;
+   }
+   ret = smrsim_pstore_write(dev, slot);
+   if (ret) {
+      printk(KERN_ERR "smrsim: persist to slot %d failed\n", slot);
+      smrsim_ptask.dirty_all = true;
+      return ret;
+   }
+   smrsim_ptask.slot = !slot;
+   smrsim_ptask.epoch = smrsim_ptask.seq;
+   smrsim_ptask.log_head = 0;
+   smrsim_ptask.log_rec = 0;
+   smrsim_ptask.ckpt_time = jiffies;
+   if (smrsim_dbg_log_enabled && printk_ratelimit()) {
+      printk(KERN_INFO "smrsim: persist to slot %d success\n", slot);
+   }
+   return 0;
 }
 
-static __u32 smrsim_pstore_pg_idx(__u32 idx, 
-                                  __u32 *pg_nxt)
+static int smrsim_save_persistence(struct dm_target* ti)
 {
-   __u32 tmp = SMR_PSTORE_PG_OFF + sizeof(struct smrsim_zone_stats) * idx;
-   __u32 pg_cur = tmp / PAGE_SIZE;
-   
-   *pg_nxt = tmp % PAGE_SIZE ? pg_cur + 1 : pg_cur;
-   return pg_cur;
+   return smrsim_pstore_checkpoint(ti, true);
 }
 
 static int smrsim_flush_persistence(struct dm_target* ti)
 {
-   void            *page_addr;
-   struct page     *page;
-   struct smrsim_c *zdev;
-   __u32            idx;
-   __u32            crc;
-   __u32            pg_cur;
-   __u32            pg_nxt;
-   __u32            qidx;
+   return smrsim_pstore_checkpoint(ti, false);
+}
 
-   zdev = ti->private;
-   page = alloc_pages(GFP_KERNEL, 0);
-   if (!page) {
-      printk(KERN_ERR "smrsim: no enough memory to allocate a page\n");
-      return -ENOMEM;
+/*
+ * Check the descriptor of slot, as read. Returns its seq, or 0 if the
+ * slot holds no image.
+ */
+static __u64 smrsim_pstore_check_desc(__u8 slot,
+                                      struct smrsim_pstore_desc *desc)
+{
+   if ((desc->magic != SMR_PSTORE_MAGIC) ||
+       (desc->length < sizeof(struct smrsim_state)) ||
+       ((desc->format != SMR_PSTORE_FMT_RAW) && (desc->format != SMR_PSTORE_FMT_COMPACT)) ||
+       ((desc->format == SMR_PSTORE_FMT_RAW) && (desc->bytes != desc->length)) ||
+       !desc->bytes || (DIV_ROUND_UP(desc->bytes, PAGE_SIZE) > SMR_PSTORE_PAGES)) {
+      return 0;
    }
-   page_addr = page_address(page);
-   if (!page_addr) {
-      printk(KERN_ERR "smrsim: write page vm addr null\n");
-      __free_pages(page, 0);
-      return -EINVAL;
+   if (desc->crc32 != crc32(0, (unsigned char *)desc->pcrc,
+                            DIV_ROUND_UP(desc->bytes, PAGE_SIZE) * sizeof(__u32))) {
+      printk(KERN_ERR "smrsim: slot %u descriptor crc checking\n", slot);
+      return 0;
    }
- 
-   crc = crc32(0, (unsigned char *)zone_state + sizeof(struct smrsim_state_header), 
-               zone_state->header.length - sizeof(struct smrsim_state_header));
-   zone_state->header.crc32 = crc;
-   if (smrsim_ptask.flag &= SMR_CONFIG_CHANGE) {
-       smrsim_ptask.flag &= ~SMR_CONFIG_CHANGE;
-   }
-   memcpy(page_addr, (unsigned char *)zone_state, PAGE_SIZE);      
-   smrsim_write_page(zdev->dev->bdev, smrsim_ptask.pstore_lba, PAGE_SIZE, page);
- 
-   if (smrsim_ptask.flag &= SMR_STATS_CHANGE) {
-      smrsim_ptask.flag &= ~SMR_STATS_CHANGE;
-      if (smrsim_ptask.sts_zone_idx > SMR_PSTORE_PG_EDG) {
-         pg_cur = smrsim_pstore_pg_idx(smrsim_ptask.sts_zone_idx, &pg_nxt);
-         smrsim_ptask.sts_zone_idx = 0; 
-         for (idx = pg_cur; idx <= pg_nxt; idx++) {
-            memcpy(page_addr, ((unsigned char *)zone_state + 
-                   idx * PAGE_SIZE), PAGE_SIZE);
-            smrsim_write_page(zdev->dev->bdev, smrsim_ptask.pstore_lba + 
-                             (idx << SMR_PAGE_SIZE_SHIFT_DEFAULT), 
-                             PAGE_SIZE, page);
-         }
-      }
+   return desc->seq;
+}
+
+/*
+ * Replace the pages of img in bad, as described by desc, with the ones
+ * of slot alt that match desc's crc. Returns the number of pages left
+ * bad.
+ */
+static __u32 smrsim_pstore_repair(struct block_device *dev,
+                                  __u8 slot,
+                                  struct smrsim_pstore_desc *desc,
+                                  struct smrsim_pstore_desc *alt,
+                                  void *img,
+                                  unsigned long *bad)
+{
+   __u32 num_pages = DIV_ROUND_UP(desc->bytes, PAGE_SIZE);
+   __u32 nbad = 0;
+   __u32 crc;
+   __u32 pg;
+   void *buf;
+   int   ret;
+
+   buf = vmalloc(PAGE_SIZE);
+   if (!buf || !alt || (alt->length != desc->length) || (alt->format != desc->format)) {
+      vfree(buf);
+      return bitmap_weight(bad, num_pages);
    }
-   if (smrsim_ptask.flag &= SMR_STATUS_CHANGE) {
-      smrsim_ptask.flag &= ~SMR_STATUS_CHANGE;
-      for (qidx = 0; qidx < smrsim_ptask.stu_zone_idx_cnt; qidx++) {
-         pg_cur = smrsim_pstore_pg_idx(smrsim_ptask.stu_zone_idx[qidx], &pg_nxt);
-         smrsim_ptask.stu_zone_idx[qidx] = 0;
-         for (idx = pg_cur; idx <= pg_nxt; idx++) {
-            memcpy(page_addr, ((unsigned char *)zone_state + 
-                   idx * PAGE_SIZE), PAGE_SIZE);
-            smrsim_write_page(zdev->dev->bdev, smrsim_ptask.pstore_lba + 
-                             (idx << SMR_PAGE_SIZE_SHIFT_DEFAULT), 
-                             PAGE_SIZE, page);
-         }
+   for_each_set_bit(pg, bad, num_pages) {
+      smrsim_pstore_start();
+      ret = smrsim_pstore_submit(dev, SMRSIM_IO_READ, buf,
+                                 smrsim_pstore_slot_lba(slot) +
+                                 ((sector_t)(pg + 1) << SMR_PAGE_SIZE_SHIFT_DEFAULT), 1);
+      if (smrsim_pstore_wait() || ret) {
+         nbad++;
+         continue;
       }
-      smrsim_ptask.stu_zone_idx_cnt = 0;
-      smrsim_ptask.stu_zone_idx_gap = 0;
-   }
-   if (smrsim_dbg_log_enabled && printk_ratelimit()) {
-      printk(KERN_INFO "smrsim: flush persist success\n");
+      invalidate_kernel_vmap_range(buf, PAGE_SIZE);
+      crc = smrsim_pstore_page_crc(buf, 0);
+      if (crc != desc->pcrc[pg]) {
+         nbad++;
+         continue;
+      }
+      memcpy((unsigned char *)img + pg * PAGE_SIZE, buf, PAGE_SIZE);
+      printk(KERN_INFO "smrsim: page %u taken from slot %u\n", pg, slot);
    }
-   __free_pages(page, 0);
-   return 0;
+   vfree(buf);
+   return nbad;
 }
 
-static int smrsim_save_persistence(struct dm_target* ti)
+/*
+ * Read the image of slot into a new zone_state, checked page by page
+ * against its descriptor. Bad pages are reported and repaired from slot
+ * alt if given. A compact image is read into a buffer and decoded.
+ */
+static int smrsim_pstore_read_slot(struct block_device *dev,
+                                   __u8 slot,
+                                   struct smrsim_pstore_desc *desc,
+                                   struct smrsim_pstore_desc *alt)
 {
-   void            *page_addr;
-   struct page     *page;
-   struct smrsim_c *zdev;
-   __u32            num_pages;
-   __u32            part_page;
-   __u32            idx;
-   __u32            crc;
+   __u32 num_pages = DIV_ROUND_UP(desc->bytes, PAGE_SIZE);
+   unsigned long *bad = NULL;
+   void *img = NULL;
+   __u32 nbad = 0;
+   __u32 pg;
+   int   ret;
 
-   zdev = ti->private;
-   page = alloc_pages(GFP_KERNEL, 0);
-   if (!page) {
-      printk(KERN_ERR "smrsim: no enough memory to allocate a page\n");
-      return -ENOMEM;
+   zone_state = vzalloc(DIV_ROUND_UP(desc->length, PAGE_SIZE) * PAGE_SIZE);
+   img = zone_state;
+   if (desc->format == SMR_PSTORE_FMT_COMPACT) {
+      img = vmalloc(num_pages * PAGE_SIZE);
    }
-   page_addr = page_address(page);
-   if (!page_addr) {
-      printk(KERN_ERR "smrsim: write page vm addr null\n");
-      __free_pages(page, 0);
-      return -EINVAL;
+   bad = kcalloc(BITS_TO_LONGS(num_pages), sizeof(unsigned long), GFP_KERNEL);
+   if (!zone_state || !img || !bad) {
+      printk(KERN_ERR "smrsim: zome_state error: no enough memory\n");
+      goto rderr;
    }
-   num_pages = div_u64_rem(zone_state->header.length, PAGE_SIZE, &part_page);
-   crc = crc32(0, (unsigned char *)zone_state + sizeof(struct smrsim_state_header), 
-               zone_state->header.length - sizeof(struct smrsim_state_header));
-   zone_state->header.crc32 = crc;
-   for (idx = 0; idx < num_pages; idx++) {
-      memcpy(page_addr, ((unsigned char *)zone_state + 
-             idx * PAGE_SIZE), PAGE_SIZE);
-      smrsim_write_page(zdev->dev->bdev, smrsim_ptask.pstore_lba + 
-                       (idx << SMR_PAGE_SIZE_SHIFT_DEFAULT), 
-                       PAGE_SIZE, page);
-   }
-   if (part_page) {
-      memcpy(page_addr, ((unsigned char *)zone_state +
-             num_pages * PAGE_SIZE), part_page);      
-      smrsim_write_page(zdev->dev->bdev, smrsim_ptask.pstore_lba +
-                       (num_pages << SMR_PAGE_SIZE_SHIFT_DEFAULT), 
-                       PAGE_SIZE, page);
+   smrsim_pstore_start();
+   ret = smrsim_pstore_submit(dev, SMRSIM_IO_READ, img,
+                              smrsim_pstore_slot_lba(slot) + (1 << SMR_PAGE_SIZE_SHIFT_DEFAULT),
+                              num_pages);
+   if (smrsim_pstore_wait() || ret) {
+      goto rderr;
    }
-   if (smrsim_dbg_log_enabled && printk_ratelimit()) {
-      printk(KERN_INFO "smrsim: save persist success\n");
+   invalidate_kernel_vmap_range(img, num_pages * PAGE_SIZE);
+   for (pg = 0; pg < num_pages; pg++) {
+      if (smrsim_pstore_page_crc(img, pg) != desc->pcrc[pg]) {
+         printk(KERN_ERR "smrsim:error: slot %u page %u crc checking\n", slot, pg);
+         set_bit(pg, bad);
+         nbad++;
+      }
+   }
+   if (nbad) {
+      nbad = smrsim_pstore_repair(dev, !slot, desc, alt, img, bad);
+   }
+   if (nbad) {
+      printk(KERN_ERR "smrsim:error: slot %u has %u bad pages\n", slot, nbad);
+      goto rderr;
+   }
+   if ((img != zone_state) &&
+       smrsim_pstore_decode(img, desc->bytes, zone_state, desc->length)) {
+      printk(KERN_ERR "smrsim: slot %u compact image doesn't decode\n", slot);
+      goto rderr;
+   }
+   if ((zone_state->header.magic != 0xBEEFBEEF) ||
+       (zone_state->header.length != desc->length)) {
+      printk(KERN_ERR "smrsim: slot %u image doesn't match its descriptor\n", slot);
+      goto rderr;
+   }
+   kfree(bad);
+   if (img != zone_state) {
+      vfree(img);
    }
-   __free_pages(page, 0);
    return 0;
+   rderr:
+   kfree(bad);
+   if (img != zone_state) {
+      vfree(img);
+   }
+   vfree(zone_state);
+   zone_state = NULL;
+   return -EINVAL;
 }
 
 static int smrsim_load_persistence(struct dm_target* ti)
 {
    __u64            sizedev;
-   void            *page_addr;
-   struct page     *page;
+   struct page     *page[SMR_PSTORE_SLOTS];
    struct smrsim_c *zdev;
-   __u32            num_pages;
-   __u32            part_page;
-   __u32            idx;
-   __u32            crc;
-   struct smrsim_state_header header;
+   struct block_device *dev;
+   struct smrsim_pstore_logpg *log;
+   __u64            seq[SMR_PSTORE_SLOTS];
+   __u8             slot;
+   __u8             idx;
 
    printk(KERN_INFO "smrsim: Load persistence\n");
    zdev = ti->private;
+   dev = smrsim_pstore_bdev(ti);
    sizedev = ti->len;
    smrsim_init_zone_default(sizedev);
-   smrsim_ptask.pstore_lba = SMR_NUMZONES_DEFAULT
-                          << SMR_ZONE_SIZE_SHIFT_DEFAULT
-                          << SMR_BLOCK_SIZE_SHIFT_DEFAULT;
-   page = alloc_pages(GFP_KERNEL, 0);
-   if (!page) {
+   smrsim_ptask.pstore_lba = 0;
+   if (!zdev->meta_dev) {
+      smrsim_ptask.pstore_lba = SMR_NUMZONES_DEFAULT
+                             << SMR_ZONE_SIZE_SHIFT_DEFAULT
+                             << SMR_BLOCK_SIZE_SHIFT_DEFAULT;
+   }
+   smrsim_ptask.seq  = 0;
+   smrsim_ptask.slot = 0;
+   smrsim_ptask.epoch = 0;
+   smrsim_ptask.log_head = 0;
+   smrsim_ptask.log_rec = 0;
+   smrsim_ptask.ckpt_time = jiffies;
+   log = smrsim_ptask.log;
+   if (!log) {
+      log = vzalloc(SMR_PSTORE_LOG);
+      if (!log) {
+         printk(KERN_ERR "smrsim: no enough memory to replay the journal\n");
+      }
+   }
+   page[0] = alloc_pages(GFP_KERNEL | __GFP_ZERO, 0);
+   page[1] = alloc_pages(GFP_KERNEL | __GFP_ZERO, 0);
+   if (!page[0] || !page[1]) {
       printk(KERN_ERR "smrsim: no enough memory to allocate a page\n");
       goto pgerr;
    }
-   page_addr = page_address(page);
-     if (!page_addr) {
-      printk(KERN_ERR "smrsim: read page vm addr null\n");
-      goto rderr;
-   }   
-   memset(page_addr, 0, PAGE_SIZE);
-   smrsim_read_page(zdev->dev->bdev, smrsim_ptask.pstore_lba, PAGE_SIZE, page);
-   memcpy(&header, page_addr, sizeof(struct smrsim_state_header));
-   if (header.magic == 0xBEEFBEEF) {
-      zone_state = vzalloc(header.length);
-      if (!zone_state) {
-         printk(KERN_ERR "smrsim: zome_state error: no enough memory\n");
-         goto rderr;
-      }
-      num_pages = div_u64_rem(header.length, PAGE_SIZE, &part_page);
-      if (num_pages) {
-         memcpy((unsigned char *)zone_state, page_addr, PAGE_SIZE);         
-      }
-      for (idx = 1; idx < num_pages; idx++) {
-         memset(page_addr, 0, PAGE_SIZE);
-         smrsim_read_page(zdev->dev->bdev, smrsim_ptask.pstore_lba + 
-            (idx << SMR_PAGE_SIZE_SHIFT_DEFAULT),
-            PAGE_SIZE, page);
-         memcpy(((unsigned char *)zone_state + 
-            idx * PAGE_SIZE), page_addr, PAGE_SIZE);
-      }
-      if (part_page) {
-         if (num_pages) {
-            memset(page_addr, 0, PAGE_SIZE);
-            smrsim_read_page(zdev->dev->bdev, smrsim_ptask.pstore_lba +
-               (num_pages << SMR_PAGE_SIZE_SHIFT_DEFAULT),
-                PAGE_SIZE, page);
-         }
-         memcpy(((unsigned char *)zone_state +
-            num_pages * PAGE_SIZE), page_addr, part_page);
-      }
-      crc = crc32(0, (unsigned char *)zone_state + sizeof(struct smrsim_state_header), 
-               zone_state->header.length - sizeof(struct smrsim_state_header));
-      if (crc != zone_state->header.crc32) {
-         printk(KERN_ERR "smrsim:error: crc checking. apply default config ...\n");  
-         goto rderr;
-      }
-      SMR_NUMZONES = zone_state->stats.num_zones;
-      zone_status =(struct smrsim_zone_status *)
-                   &zone_state->stats.zone_stats[SMR_NUMZONES];  
-      SMR_ZONE_SIZE_SHIFT = index_power_of_2(zone_status[0].z_length
-		                             >> SMR_BLOCK_SIZE_SHIFT);
-      printk(KERN_INFO "smrsim: Load persist success\n");
-   } else {
-      printk(KERN_ERR "smrsim: Load persistence magic doesn't match. Setup the default\n");
-      goto rderr;
+   /*
+    * Both descriptors and the journal are read in one batch. Each is
+    * checked by its crcs, so a failed read only fails its own checks.
+    */
+   smrsim_pstore_start();
+   for (idx = 0; idx < SMR_PSTORE_SLOTS; idx++) {
+      smrsim_pstore_submit(dev, SMRSIM_IO_READ, page_address(page[idx]),
+                           smrsim_pstore_slot_lba(idx), 1);
    }
-   __free_pages(page, 0);
+   if (log) {
+      smrsim_pstore_submit(dev, SMRSIM_IO_READ, log, smrsim_pstore_log_lba(),
+                           SMR_PSTORE_LOG / PAGE_SIZE);
+   }
+   smrsim_pstore_wait();
+   if (log) {
+      invalidate_kernel_vmap_range(log, SMR_PSTORE_LOG);
+   }
+   for (idx = 0; idx < SMR_PSTORE_SLOTS; idx++) {
+      seq[idx] = smrsim_pstore_check_desc(idx, page_address(page[idx]));
+      smrsim_ptask.seq = max(smrsim_ptask.seq, seq[idx]);
+   }
+   slot = (seq[1] > seq[0]);
+   for (idx = 0; idx < SMR_PSTORE_SLOTS; idx++, slot = !slot) {
+      if (seq[slot] &&
+          !smrsim_pstore_read_slot(dev, slot, page_address(page[slot]),
+                                   seq[!slot] ? page_address(page[!slot]) : NULL)) {
+         break;
+      }
+   }
+   if (idx == SMR_PSTORE_SLOTS) {
+      printk(KERN_ERR "smrsim: Load persistence found no valid slot. Setup the default\n");
+      goto pgerr;
+   }
+   SMR_NUMZONES = zone_state->stats.num_zones;
+   if (!smrsim_pstore_fits(SMR_NUMZONES)) {
+      printk(KERN_ERR "smrsim: Load persistence found %u zones, too many for a slot. Setup the default\n",
+             SMR_NUMZONES);
+      goto pgerr;
+   }
+   zone_status =(struct smrsim_zone_status *)
+                &zone_state->stats.zone_stats[SMR_NUMZONES];  
+   SMR_ZONE_SIZE_SHIFT = index_power_of_2(zone_status[0].z_length
+                                          >> SMR_BLOCK_SIZE_SHIFT);
+   smrsim_ptask.epoch = seq[slot];
+   if (log) {
+      smrsim_ptask.log_head = smrsim_pstore_replay(log, seq[slot]);
+   }
+   smrsim_zone_tbl_setup(smrsim_zone_tbl_unpublish());
+   smrsim_pstore_dirty_setup();
+   smrsim_stat_setup();
+   smrsim_flight_setup();
+   /*
+    * The next checkpoint goes to the other slot, which may be stale or
+    * torn: write it in full.
+    */
+   smrsim_ptask.slot = !slot;
+   smrsim_ptask.dirty_all = true;
+   printk(KERN_INFO "smrsim: Load persist success from slot %u seq %llu\n",
+          slot, (unsigned long long)seq[slot]);
+   if (log != smrsim_ptask.log) {
+      vfree(log);
+   }
+   __free_pages(page[0], 0);
+   __free_pages(page[1], 0);
    return 0;
-   rderr:
-      __free_pages(page, 0);
    pgerr: 
-      smrsim_init_zone_state(sizedev);
+   if (log != smrsim_ptask.log) {
+      vfree(log);
+   }
+   if (page[0]) {
+      __free_pages(page[0], 0);
+   }
+   if (page[1]) {
+      __free_pages(page[1], 0);
+   }
+   smrsim_init_zone_state(sizedev);
    return -EINVAL;
 }
 
+/*
+ * In journal mode: time to checkpoint the image rather than append.
+ */
+static bool smrsim_pstore_ckpt_due(void)
+{
+   return smrsim_ptask.dirty_all ||
+          (smrsim_ptask.log_head >= SMR_PSTORE_LOG / PAGE_SIZE / 2) ||
+          (smrsim_pstore_pending() &&
+           time_after_eq(jiffies, smrsim_ptask.ckpt_time + msecs_to_jiffies(SMR_PSTORE_CKPT)));
+}
+
+static bool smrsim_pstore_due(void)
+{
+   unsigned long since = smrsim_ptask.dirty_since;
+
+   if (smrsim_ptask.sync) {
+      return (smrsim_ptask.flag & SMR_CONFIG_CHANGE) ||
+             !bio_list_empty(&smrsim_ptask.sync_bios);
+   }
+   if ((smrsim_ptask.flag & SMR_CONFIG_CHANGE) ||
+       (smrsim_pstore_journal() && smrsim_pstore_ckpt_due())) {
+      return true;
+   }
+   if (!since) {
+      return false;
+   }
+   return smrsim_ptask.kick ||
+          (smrsim_ptask.dirty_thresh &&
+           (atomic_read(&smrsim_ptask.ndirty) >= smrsim_ptask.dirty_thresh)) ||
+          time_after_eq(jiffies, since + msecs_to_jiffies(smrsim_ptask.age_ms));
+}
+
+/*
+ * Jiffies until the next writeback falls due on age alone.
+ */
+static long smrsim_pstore_timeout(void)
+{
+   unsigned long since = smrsim_ptask.dirty_since;
+   unsigned long due   = 0;
+
+   if (smrsim_ptask.sync) {
+      return MAX_SCHEDULE_TIMEOUT;
+   }
+   if (since) {
+      due = since + msecs_to_jiffies(smrsim_ptask.age_ms);
+   }
+   if (smrsim_pstore_journal() && smrsim_pstore_pending() &&
+       (!due || time_before(smrsim_ptask.ckpt_time + msecs_to_jiffies(SMR_PSTORE_CKPT), due))) {
+      due = smrsim_ptask.ckpt_time + msecs_to_jiffies(SMR_PSTORE_CKPT);
+   }
+   if (!due) {
+      return MAX_SCHEDULE_TIMEOUT;
+   }
+   return time_after(due, jiffies) ? (long)(due - jiffies) : 0;
+}
+
+static int smrsim_pstore_commit(struct dm_target* ti)
+{
+   if (smrsim_ptask.flag & SMR_CONFIG_CHANGE) {
+      return smrsim_save_persistence(ti);
+   }
+   if (!smrsim_pstore_journal() || smrsim_pstore_ckpt_due()) {
+      return smrsim_flush_persistence(ti);
+   }
+   return smrsim_pstore_append(ti);
+}
+
+/*
+ * Hold a completed flush or FUA write until the metadata is committed.
+ */
+static void smrsim_pstore_hold(struct bio *bio)
+{
+   unsigned long flags;
+
+   spin_lock_irqsave(&smrsim_ptask.sync_lock, flags);
+   bio_list_add(&smrsim_ptask.sync_bios, bio);
+   spin_unlock_irqrestore(&smrsim_ptask.sync_lock, flags);
+   wake_up(&smrsim_ptask.wq);
+}
+
+/*
+ * Commit the dirty state for the held bios, then complete them. Writes
+ * completed before a flush are in the snapshot taken here.
+ */
+static void smrsim_pstore_sync(struct dm_target* ti)
+{
+   struct bio_list bios;
+   struct bio *bio;
+   unsigned long flags;
+   int ret = 0;
+
+   bio_list_init(&bios);
+   spin_lock_irqsave(&smrsim_ptask.sync_lock, flags);
+   bio_list_merge(&bios, &smrsim_ptask.sync_bios);
+   bio_list_init(&smrsim_ptask.sync_bios);
+   spin_unlock_irqrestore(&smrsim_ptask.sync_lock, flags);
+   if ((smrsim_ptask.flag & SMR_CONFIG_CHANGE) ||
+       smrsim_ptask.dirty_since || smrsim_ptask.dirty_all) {
+      ret = smrsim_pstore_commit(ti);
+   }
+   while ((bio = bio_list_pop(&bios))) {
+      smrsim_bio_endio(bio, ret ? -EIO : 0);
+   }
+}
+
 static int smrsim_persistence_task(void *arg)
 {   
    struct dm_target* ti = (struct dm_target *)arg;
 
    while (!kthread_should_stop()) {
-      if (smrsim_ptask.flag) {
-         mutex_lock(&smrsim_zone_lock);
-         if (smrsim_ptask.flag & SMR_CONFIG_CHANGE) {
-            if (SMR_NUMZONES == 0) {
-               smrsim_ptask.flag &= SMR_NO_CHANGE;
-            } else {
-               smrsim_save_persistence(ti);
-               smrsim_ptask.flag &= SMR_NO_CHANGE;
-            }
-         } else {
-            if (smrsim_ptask.stu_zone_idx_gap >= SMR_PSTORE_PG_GAP) {
-               smrsim_save_persistence(ti);
-               smrsim_ptask.flag &= SMR_NO_CHANGE;
-               smrsim_ptask.stu_zone_idx_gap = 0;
-               memset( smrsim_ptask.stu_zone_idx, 0, sizeof(__u32) * SMR_PSTORE_QDEPTH);
-               smrsim_ptask.stu_zone_idx_cnt = 0;
-            } else {
-               smrsim_flush_persistence(ti);
-            }
-         }
-         mutex_unlock(&smrsim_zone_lock);
+      wait_event_interruptible_timeout(smrsim_ptask.wq,
+         kthread_should_stop() || smrsim_pstore_due(), smrsim_pstore_timeout());
+      if (kthread_should_stop() || !smrsim_pstore_due()) {
+         continue;
+      }
+      if (smrsim_ptask.sync) {
+         smrsim_pstore_sync(ti);
+      } else {
+         smrsim_pstore_commit(ti);
       }
-      msleep_interruptible(SMR_PSTORE_CHECK);
+   }
+   if (smrsim_ptask.sync) {
+      smrsim_pstore_sync(ti);
    }
    return 0;
 }
@@ -591,15 +2670,25 @@ static int smrsim_persistence_thread( struct dm_target* ti)
       printk(KERN_ERR "smrsim:warning:null device target. Improper usage\n");
       return -EINVAL;
    }
-   init_completion(&smrsim_ptask.read_event);
-   init_completion(&smrsim_ptask.write_event);
    smrsim_ptask.flag = 0;
-   smrsim_ptask.stu_zone_idx_cnt = 0;
-   smrsim_ptask.stu_zone_idx_gap = 0;
-   memset( smrsim_ptask.stu_zone_idx, 0, sizeof(__u32) * SMR_PSTORE_QDEPTH);
+   init_waitqueue_head(&smrsim_ptask.wq);
+   spin_lock_init(&smrsim_ptask.sync_lock);
+   bio_list_init(&smrsim_ptask.sync_bios);
+   smrsim_pstore_clean();
+   if (smrsim_ptask.journal) {
+      smrsim_ptask.log = vzalloc(SMR_PSTORE_LOG);
+      if (!smrsim_ptask.log) {
+         printk(KERN_ERR "smrsim: no enough memory for the journal, journal off\n");
+         smrsim_ptask.journal = false;
+      }
+   }
    ret = smrsim_load_persistence(ti);
    if (ret) {
-      smrsim_save_persistence(ti);
+      /*
+       * The task writes the default image once running; the device
+       * needn't wait for it.
+       */
+      smrsim_ptask.flag = SMR_CONFIG_CHANGE;
    }
    smrsim_ptask.pstore_thread = kthread_create(smrsim_persistence_task, 
                                ti, "smrsim pdthread");
@@ -613,19 +2702,30 @@ static int smrsim_persistence_thread( struct dm_target* ti)
    return 0;
 }
 
+/*
+ * Runs from every IO, on the read fast path without any lock, so the
+ * idle times are folded in with cmpxchg rather than plain stores.
+ */
 static void smrsim_dev_idle_update(void)
 {
+   struct smrsim_idle_stats *is = &zone_state->stats.dev_stats.idle_stats;
    __u32 dt = 0;
+   __u32 old;
 
    if (jiffies > smrsim_dev_idle_checkpoint) {
       dt = (jiffies - smrsim_dev_idle_checkpoint) / HZ;
    } else {
       dt = (~(__u32)0 - smrsim_dev_idle_checkpoint + jiffies) / HZ;
    } 
-   if (dt > zone_state->stats.dev_stats.idle_stats.dev_idle_time_max) {
-      zone_state->stats.dev_stats.idle_stats.dev_idle_time_max = dt;
-   } else if (dt && (dt < zone_state->stats.dev_stats.idle_stats.dev_idle_time_min)) {
-      zone_state->stats.dev_stats.idle_stats.dev_idle_time_min = dt;
+   while (dt > (old = ACCESS_ONCE(is->dev_idle_time_max))) {
+      if (cmpxchg(&is->dev_idle_time_max, old, dt) == old) {
+         return;
+      }
+   }
+   while (dt && (dt < (old = ACCESS_ONCE(is->dev_idle_time_min)))) {
+      if (cmpxchg(&is->dev_idle_time_min, old, dt) == old) {
+         return;
+      }
    }
 }
 
@@ -692,9 +2792,9 @@ int smrsim_get_num_zones(__u32* num_zones)
       printk(KERN_ERR "smrsim: NULL pointer passed through\n");
       return -EINVAL;
    }
-   mutex_lock(&smrsim_zone_lock);
+   down_read(&smrsim_zone_lock);
    *num_zones = SMR_NUMZONES;
-   mutex_unlock(&smrsim_zone_lock);
+   up_read(&smrsim_zone_lock);
    return 0;
 }
 EXPORT_SYMBOL(smrsim_get_num_zones);
@@ -706,36 +2806,52 @@ int smrsim_get_size_zone_default(__u32* size_zone)
       printk(KERN_ERR "smrsim: NULL pointer passed through\n");
       return -EINVAL;
    }
-   mutex_lock(&smrsim_zone_lock);
+   down_read(&smrsim_zone_lock);
    *size_zone = num_sectors_zone();
-   mutex_unlock(&smrsim_zone_lock);
+   up_read(&smrsim_zone_lock);
    return 0;
 }
 EXPORT_SYMBOL(smrsim_get_size_zone_default);
 
+/*
+ * Zone geometry changes swap the image and unpublish the zone table in
+ * a smrsim_conf_seq write section; the rest may sleep and runs outside.
+ */
 int smrsim_set_size_zone_default(__u32 size_zone)
 {
-   struct smrsim_state *sta_tmp;
+   struct smrsim_state    *sta_tmp;
+   struct smrsim_zone_tbl *zt;
+   __u32 shift;
+   __u32 num_zones;
 
    printk(KERN_INFO "smrsim: %s: called.\n", __FUNCTION__);
    if ((size_zone % (1 << SMR_BLOCK_SIZE_SHIFT)) || !(is_power_of_2(size_zone))) {
       printk(KERN_ERR "smrsim: Wong zone size specified\n");
       return -EINVAL;
    }
-   mutex_lock(&smrsim_zone_lock);
-   SMR_ZONE_SIZE_SHIFT = index_power_of_2((size_zone) >> SMR_BLOCK_SIZE_SHIFT);   
-   SMR_NUMZONES = ((SMR_CAPACITY >> SMR_BLOCK_SIZE_SHIFT) 
-                  >> SMR_ZONE_SIZE_SHIFT);
-   sta_tmp = vzalloc(smrsim_state_size()); 
+   down_write(&smrsim_zone_lock);
+   shift = index_power_of_2((size_zone) >> SMR_BLOCK_SIZE_SHIFT);   
+   num_zones = ((SMR_CAPACITY >> SMR_BLOCK_SIZE_SHIFT) >> shift);
+   if (!smrsim_pstore_fits(num_zones)) {
+      up_write(&smrsim_zone_lock);
+      printk(KERN_ERR "smrsim: %u zones don't fit the persistence slot\n", num_zones);
+      return -EINVAL;
+   }
+   sta_tmp = vzalloc(smrsim_state_size_zones(num_zones)); 
    if (!sta_tmp) {
-      mutex_unlock(&smrsim_zone_lock);
+      up_write(&smrsim_zone_lock);
       printk(KERN_ERR "smrsim: zone_state memory realloc failed\n");
       return -EINVAL;
    }
-   vfree(zone_state);
-   zone_state = sta_tmp;
-   smrsim_init_zone_state_default(smrsim_state_size());
-   mutex_unlock(&smrsim_zone_lock);
+   write_seqcount_begin(&smrsim_conf_seq);
+   SMR_ZONE_SIZE_SHIFT = shift;
+   SMR_NUMZONES = num_zones;
+   swap(zone_state, sta_tmp);
+   zt = smrsim_zone_tbl_unpublish();
+   write_seqcount_end(&smrsim_conf_seq);
+   smrsim_init_zone_state_default(smrsim_state_size(), zt);
+   smrsim_state_retire(sta_tmp);
+   up_write(&smrsim_zone_lock);
    trace_smrsim_gen_evt("dm-smrsim", "reset zone size to the default value");
    return 0;
 }
@@ -754,14 +2870,15 @@ EXPORT_SYMBOL(smrsim_reset_default_config);
 int smrsim_reset_default_device_config(void)
 {
    printk(KERN_INFO "%s: called.\n", __FUNCTION__);
-   mutex_lock(&smrsim_zone_lock);
+   down_write(&smrsim_zone_lock);
    zone_state->config.dev_config.out_of_policy_read_flag  = 0;
    zone_state->config.dev_config.out_of_policy_write_flag = 0;
    zone_state->config.dev_config.r_time_to_rmw_zone = 
                                  SMR_OUT_OF_POLICY_PENALTY;
    zone_state->config.dev_config.w_time_to_rmw_zone = 
                                  SMR_OUT_OF_POLICY_PENALTY;
-   mutex_unlock(&smrsim_zone_lock);
+   smrsim_pstore_mark(&zone_state->config, sizeof(struct smrsim_config));
+   up_write(&smrsim_zone_lock);
    trace_smrsim_gen_evt("dm-smrsim", "reset device to the default config");
    return 0;
 }
@@ -774,10 +2891,10 @@ int smrsim_get_device_config(struct smrsim_dev_config *device_config)
       printk(KERN_ERR "smrsim: NULL pointer passed through\n");
       return -EINVAL;
    }
-   mutex_lock(&smrsim_zone_lock);
+   down_read(&smrsim_zone_lock);
    memcpy(device_config, &(zone_state->config.dev_config), 
           sizeof(struct smrsim_dev_config));
-   mutex_unlock(&smrsim_zone_lock);
+   up_read(&smrsim_zone_lock);
    return 0;
 }
 EXPORT_SYMBOL(smrsim_get_device_config);
@@ -789,10 +2906,11 @@ int smrsim_set_device_rconfig(struct smrsim_dev_config *device_config)
       printk(KERN_ERR "smrsim: null pointer passed through\n");
       return -EINVAL;
    }
-   mutex_lock(&smrsim_zone_lock);
+   down_write(&smrsim_zone_lock);
    zone_state->config.dev_config.out_of_policy_read_flag =
       device_config->out_of_policy_read_flag;
-   mutex_unlock(&smrsim_zone_lock);
+   smrsim_pstore_mark(&zone_state->config, sizeof(struct smrsim_config));
+   up_write(&smrsim_zone_lock);
    trace_smrsim_gen_evt("dm-smrsim", "set device read config");
    return 0;
 }
@@ -805,10 +2923,11 @@ int smrsim_set_device_wconfig(struct smrsim_dev_config *device_config)
       printk(KERN_ERR "smrsim: null pointer passed through\n");
       return -EINVAL;
    }
-   mutex_lock(&smrsim_zone_lock);
+   down_write(&smrsim_zone_lock);
    zone_state->config.dev_config.out_of_policy_write_flag =
       device_config->out_of_policy_write_flag;
-   mutex_unlock(&smrsim_zone_lock);
+   smrsim_pstore_mark(&zone_state->config, sizeof(struct smrsim_config));
+   up_write(&smrsim_zone_lock);
    trace_smrsim_gen_evt("dm-smrsim", "set device write config");
    return 0;
 }
@@ -825,10 +2944,11 @@ int smrsim_set_device_rconfig_delay(struct smrsim_dev_config *device_config)
       printk(KERN_ERR "time delay exceeds default maximum\n");
       return -EINVAL;
    }
-   mutex_lock(&smrsim_zone_lock);
+   down_write(&smrsim_zone_lock);
    zone_state->config.dev_config.r_time_to_rmw_zone =
       device_config->r_time_to_rmw_zone;
-   mutex_unlock(&smrsim_zone_lock);
+   smrsim_pstore_mark(&zone_state->config, sizeof(struct smrsim_config));
+   up_write(&smrsim_zone_lock);
    trace_smrsim_gen_evt("dm-smrsim", "set device read config");
    return 0;
 }
@@ -845,10 +2965,11 @@ int smrsim_set_device_wconfig_delay(struct smrsim_dev_config *device_config)
       printk(KERN_ERR "time delay exceeds allow maximum 1 minute\n");
       return -EINVAL;
    }
-   mutex_lock(&smrsim_zone_lock);
+   down_write(&smrsim_zone_lock);
    zone_state->config.dev_config.w_time_to_rmw_zone =
       device_config->w_time_to_rmw_zone;
-   mutex_unlock(&smrsim_zone_lock);
+   smrsim_pstore_mark(&zone_state->config, sizeof(struct smrsim_config));
+   up_write(&smrsim_zone_lock);
    trace_smrsim_gen_evt("dm-smrsim", "set device write config");
    return 0;
 }
@@ -856,22 +2977,26 @@ EXPORT_SYMBOL(smrsim_set_device_wconfig_delay);
 
 int smrsim_reset_default_zone_config(void)
 {
-   struct smrsim_state *sta_tmp;
+   struct smrsim_state    *sta_tmp;
+   struct smrsim_zone_tbl *zt;
 
    printk(KERN_INFO "smrsim: %s: called.\n", __FUNCTION__);
-   mutex_lock(&smrsim_zone_lock);
-   SMR_NUMZONES = SMR_NUMZONES_DEFAULT;
-   SMR_ZONE_SIZE_SHIFT = SMR_ZONE_SIZE_SHIFT_DEFAULT;
-   sta_tmp = vzalloc(smrsim_state_size());
-   vfree(zone_state); 
+   down_write(&smrsim_zone_lock);
+   sta_tmp = vzalloc(smrsim_state_size_zones(SMR_NUMZONES_DEFAULT));
    if (!sta_tmp) {
       printk(KERN_ERR "smrsim: zone_state memory realloc failed\n");
-      mutex_unlock(&smrsim_zone_lock);
+      up_write(&smrsim_zone_lock);
       return -EINVAL;
    }
-   zone_state = sta_tmp;
-   smrsim_init_zone_state_default(smrsim_state_size());
-   mutex_unlock(&smrsim_zone_lock);
+   write_seqcount_begin(&smrsim_conf_seq);
+   SMR_NUMZONES = SMR_NUMZONES_DEFAULT;
+   SMR_ZONE_SIZE_SHIFT = SMR_ZONE_SIZE_SHIFT_DEFAULT;
+   swap(zone_state, sta_tmp);
+   zt = smrsim_zone_tbl_unpublish();
+   write_seqcount_end(&smrsim_conf_seq);
+   smrsim_init_zone_state_default(smrsim_state_size(), zt);
+   smrsim_state_retire(sta_tmp);
+   up_write(&smrsim_zone_lock);
    trace_smrsim_gen_evt("dm-smrsim", "reset zone to the default config");
    return 0;
 }
@@ -879,14 +3004,32 @@ EXPORT_SYMBOL(smrsim_reset_default_zone_config);
 
 int smrsim_clear_zone_config(void)
 {
+   __u32 idx;
+
    printk(KERN_INFO "smrsim: %s: called.\n", __FUNCTION__);
+   down_write(&smrsim_zone_lock);
+   write_seqcount_begin(&smrsim_conf_seq);
    memset(zone_state->stats.zone_stats, 0, zone_state->stats.num_zones *
           sizeof (struct smrsim_zone_stats));
-   mutex_lock(&smrsim_zone_lock);
+   for (idx = 0; idx < zone_state->stats.num_zones; idx++) {
+      smrsim_stat_clear(idx);
+   }
    zone_state->stats.num_zones = 0;   
    memset(zone_status, 0, SMR_NUMZONES * sizeof (struct smrsim_zone_status));
+   memset(zone_wp, 0, SMR_NUMZONES * sizeof(__u32));
+   memset(zone_cond, 0, SMR_NUMZONES);
+   memset(zone_type, 0, SMR_NUMZONES);
+   memset(zone_flag, 0, SMR_NUMZONES);
+   for (idx = 0; idx < SMR_ZONE_CONDS; idx++) {
+      bitmap_zero(zone_cmap[idx], SMR_NUMZONES);
+   }
+   for (idx = 0; idx < SMR_ZONE_BUCKETS; idx++) {
+      bitmap_zero(zone_fmap[idx], SMR_NUMZONES);
+   }
    SMR_NUMZONES = 0;
-   mutex_unlock(&smrsim_zone_lock);
+   smrsim_zmap_resize();
+   write_seqcount_end(&smrsim_conf_seq);
+   up_write(&smrsim_zone_lock);
    trace_smrsim_gen_evt("dm-smrsim", "zone cleaned to empty");
    return 0;
 }
@@ -899,7 +3042,7 @@ static int smrsim_zone_seq_count(void)
   
    for (index = 0; index < SMR_NUMZONES; index++)
    {
-      if (zone_status[index].z_type == Z_TYPE_SEQUENTIAL)
+      if (zone_type[index] == Z_TYPE_SEQUENTIAL)
       {
           count++;
       }
@@ -937,7 +3080,7 @@ int smrsim_modify_zone_config(struct smrsim_zone_status *z_status)
       return -EINVAL;
    } 
    if (1 >= count && (Z_TYPE_CONVENTIONAL == z_status->z_type) &&
-       (Z_TYPE_SEQUENTIAL == zone_status[z_status->z_start].z_type)) {
+       (Z_TYPE_SEQUENTIAL == zone_type[z_status->z_start])) {
       printk(KERN_ERR "smrsim: zone type is not allowed to modify\n");
       return -EINVAL;
    }
@@ -950,7 +3093,7 @@ int smrsim_modify_zone_config(struct smrsim_zone_status *z_status)
       return -EINVAL;
    }
    if ((z_status->z_write_ptr_offset == num_sectors_zone()) 
-      && (zone_status[z_status->z_start].z_conds != Z_COND_FULL)) {
+      && (zone_cond[z_status->z_start] != Z_COND_FULL)) {
       printk(KERN_ERR "smrsim: zone wp and condition mismatch\n");
       return -EINVAL;
    }
@@ -973,21 +3116,24 @@ int smrsim_modify_zone_config(struct smrsim_zone_status *z_status)
       printk(KERN_ERR "smrsim: empty zone isn't empty\n");
       return -EINVAL;
    }
-   mutex_lock(&smrsim_zone_lock);
-   zone_status[z_status->z_start].z_write_ptr_offset =
-      z_status->z_write_ptr_offset;   
+   down_write(&smrsim_zone_lock);
+   write_seqcount_begin(&smrsim_conf_seq);
+   smrsim_zone_set_wp(z_status->z_start, z_status->z_write_ptr_offset);   
    zone_status[z_status->z_start].z_checkpoint_offset =
       z_status->z_checkpoint_offset;   
-   zone_status[z_status->z_start].z_conds = 
-      (enum smrsim_zone_conditions)z_status->z_conds;
-   zone_status[z_status->z_start].z_type = 
+   smrsim_zone_set_cond(z_status->z_start,
+      (enum smrsim_zone_conditions)z_status->z_conds);
+   zone_type[z_status->z_start] = 
       (enum smrsim_zone_type)z_status->z_type;
-   zone_status[z_status->z_start].z_flag = 0;
-   mutex_unlock(&smrsim_zone_lock);
+   zone_flag[z_status->z_start] = 0;
+   smrsim_zmap_update(z_status->z_start);
+   smrsim_flight_reset(z_status->z_start, z_status->z_write_ptr_offset);
+   write_seqcount_end(&smrsim_conf_seq);
+   up_write(&smrsim_zone_lock);
    printk(KERN_DEBUG "smrsim: zone[%lu] modified. type:0x%x conds:0x%x\n",
-      zone_status[z_status->z_start].z_start,
-      zone_status[z_status->z_start].z_type, 
-      zone_status[z_status->z_start].z_conds);
+      (unsigned long)z_status->z_start,
+      zone_type[z_status->z_start], 
+      zone_cond[z_status->z_start]);
    trace_smrsim_gen_evt("dm-smrsim", "the zone modified");
    return 0;
 }
@@ -1031,11 +3177,21 @@ int smrsim_add_zone_config(struct smrsim_zone_status *zone_sts)
       return -EINVAL;
    }
    zone_sts->z_flag = 0;
-   mutex_lock(&smrsim_zone_lock);
+   down_write(&smrsim_zone_lock);
+   write_seqcount_begin(&smrsim_conf_seq);
    memcpy(&(zone_status[SMR_NUMZONES]), zone_sts, sizeof(struct smrsim_zone_status));
+   zone_wp[SMR_NUMZONES]   = zone_sts->z_write_ptr_offset;
+   set_bit(SMR_NUMZONES, zone_fmap[smrsim_zone_bucket(zone_sts->z_write_ptr_offset)]);
+   zone_cond[SMR_NUMZONES] = zone_sts->z_conds;
+   set_bit(SMR_NUMZONES, zone_cmap[zone_sts->z_conds & (SMR_ZONE_CONDS - 1)]);
+   zone_type[SMR_NUMZONES] = zone_sts->z_type;
+   zone_flag[SMR_NUMZONES] = zone_sts->z_flag;
+   smrsim_zmap_update(SMR_NUMZONES);
    zone_state->stats.num_zones++;
    SMR_NUMZONES++;
-   mutex_unlock(&smrsim_zone_lock);
+   smrsim_zmap_resize();
+   write_seqcount_end(&smrsim_conf_seq);
+   up_write(&smrsim_zone_lock);
    trace_smrsim_gen_evt("dm-smrsim", "the zone added");
    return 0;
 }
@@ -1045,26 +3201,45 @@ int smrsim_reset_zone_stats(sector_t start_sector)
 {
    __u32 zone_idx  = start_sector >> SMR_BLOCK_SIZE_SHIFT >> SMR_ZONE_SIZE_SHIFT; 
 
+   unsigned long zmask;
+
    printk(KERN_INFO "smrsim: %s: called.\n", __FUNCTION__);
+   down_read(&smrsim_zone_lock);
    if (SMR_NUMZONES <= zone_idx) {
+      up_read(&smrsim_zone_lock);
       printk(KERN_ERR "smrsim: %s start sector is out of range\n", __FUNCTION__);  
       return -EINVAL;
    }
+   zmask = smrsim_zlock_mask(zone_idx, zone_idx);
+   smrsim_zlock_acquire(zmask);
    memset(&(zone_state->stats.zone_stats[zone_idx].out_of_policy_read_stats),
           0, sizeof(struct smrsim_out_of_policy_read_stats));
    memset(&(zone_state->stats.zone_stats[zone_idx].out_of_policy_write_stats),
           0, sizeof(struct smrsim_out_of_policy_write_stats));
+   smrsim_stat_clear(zone_idx);
+   smrsim_pstore_mark(&zone_state->stats.zone_stats[zone_idx],
+                      sizeof(struct smrsim_zone_stats));
+   smrsim_zlock_release(zmask);
+   up_read(&smrsim_zone_lock);
    trace_smrsim_gen_evt("dm-smrsim", "zone stats reset");
    return 0;
 }
 EXPORT_SYMBOL(smrsim_reset_zone_stats);
 
+/*
+ * Caller holds smrsim_zone_lock exclusive.
+ */
 int smrsim_reset_stats(void)
 {
+   __u32 idx;
+
    printk(KERN_INFO "smrsim: %s: called.\n", __FUNCTION__);
    memset(&zone_state->stats.dev_stats.idle_stats, 0, sizeof(struct smrsim_idle_stats));
    memset(zone_state->stats.zone_stats, 0, zone_state->stats.num_zones * 
           sizeof(struct smrsim_zone_stats));
+   for (idx = 0; idx < zone_state->stats.num_zones; idx++) {
+      smrsim_stat_clear(idx);
+   }
    trace_smrsim_gen_evt("dm-smrsim", "reset zone stats"); 
    return 0;
 }
@@ -1077,95 +3252,810 @@ int smrsim_get_stats(struct smrsim_stats *stats)
       printk(KERN_ERR "smrsim: null pointer passed through\n");
       return -EINVAL;
    }
+   down_read(&smrsim_zone_lock);
+   smrsim_stat_fold(0, SMR_NUMZONES);
    memcpy(stats, &(zone_state->stats), smrsim_stats_size());
+   up_read(&smrsim_zone_lock);
    return 0;
 }
 EXPORT_SYMBOL(smrsim_get_stats);
 
-int smrsim_blkdev_reset_zone_ptr(sector_t start_sector)
+int smrsim_get_stats64(struct smrsim_stats64 *stats)
+{
+   struct smrsim_zone_stats64 *zs;
+   __u32 idx;
+   __u32 num;
+
+   if (!stats) {
+      printk(KERN_ERR "smrsim: null pointer passed through\n");
+      return -EINVAL;
+   }
+   down_read(&smrsim_zone_lock);
+   num = min(stats->num_zones, SMR_NUMZONES);
+   stats->version = SMRSIM_STATS64_VERSION;
+   stats->dev_stats = zone_state->stats.dev_stats;
+   for (idx = 0; idx < num; idx++) {
+      zs = &stats->zone_stats[idx];
+      zs->out_of_policy_read_stats.beyond_swp_count = 
+         smrsim_stat_sum(idx, SMR_STAT_R_BEYOND_SWP);
+      zs->out_of_policy_read_stats.span_zones_count = 
+         smrsim_stat_sum(idx, SMR_STAT_R_SPAN_ZONES);
+      zs->out_of_policy_write_stats.not_on_swp_count = 
+         smrsim_stat_sum(idx, SMR_STAT_W_NOT_ON_SWP);
+      zs->out_of_policy_write_stats.span_zones_count = 
+         smrsim_stat_sum(idx, SMR_STAT_W_SPAN_ZONES);
+      zs->out_of_policy_write_stats.unaligned_count = 
+         smrsim_stat_sum(idx, SMR_STAT_W_UNALIGNED);
+   }
+   stats->num_zones = SMR_NUMZONES;
+   up_read(&smrsim_zone_lock);
+   return 0;
+}
+EXPORT_SYMBOL(smrsim_get_stats64);
+
+/*
+ * Reset the WP of the zone starting at start_sector, or with finish set
+ * move it to the zone end as ZBC FINISH ZONE does. Read only and offline
+ * zones fail with -EIO.
+ */
+static int smrsim_zone_wp_op(sector_t start_sector,
+                             bool finish)
 {
    __u32 rem;
    __u32 zone_idx;
+   unsigned long zmask;
 
-   printk(KERN_INFO "smrsim: %s: called.\n", __FUNCTION__);
-   mutex_lock(&smrsim_zone_lock);
+   down_read(&smrsim_zone_lock);
    zone_idx = start_sector >> SMR_BLOCK_SIZE_SHIFT >> SMR_ZONE_SIZE_SHIFT; 
    if (SMR_NUMZONES <= zone_idx) {
-      mutex_unlock(&smrsim_zone_lock);
+      up_read(&smrsim_zone_lock);
       printk(KERN_ERR "smrsim: %s start_sector is out of range\n", __FUNCTION__);  
       return -EINVAL;
    }
-   if (zone_status[zone_idx].z_type == Z_TYPE_CONVENTIONAL) {
-      mutex_unlock(&smrsim_zone_lock);
+   zmask = smrsim_zlock_mask(zone_idx, zone_idx);
+   smrsim_zlock_acquire(zmask);
+   if (zone_type[zone_idx] == Z_TYPE_CONVENTIONAL) {
+      smrsim_zlock_release(zmask);
+      up_read(&smrsim_zone_lock);
       printk(KERN_ERR "smrsim:error: CMR zone dosen't have a write pointer.\n");
       return -EINVAL;
    }
-   div_u64_rem(start_sector, (1 << SMR_BLOCK_SIZE_SHIFT << SMR_ZONE_SIZE_SHIFT), &rem);
-   if (rem) {
-      mutex_unlock(&smrsim_zone_lock);
-      printk(KERN_ERR "smrsim: %s start_sector is not the begining of a zone\n", 
-             __FUNCTION__);  
+   div_u64_rem(start_sector, (1 << SMR_BLOCK_SIZE_SHIFT << SMR_ZONE_SIZE_SHIFT), &rem);
+   if (rem) {
+      smrsim_zlock_release(zmask);
+      up_read(&smrsim_zone_lock);
+      printk(KERN_ERR "smrsim: %s start_sector is not the begining of a zone\n", 
+             __FUNCTION__);  
+      return -EINVAL;
+   }
+   if ((zone_cond[zone_idx] == Z_COND_RO) || (zone_cond[zone_idx] == Z_COND_OFFLINE)) {
+      smrsim_zlock_release(zmask);
+      up_read(&smrsim_zone_lock);
+      printk(KERN_ERR "smrsim: %s zone %u is read only or offline\n", 
+             __FUNCTION__, zone_idx);  
+      return -EIO;
+   }
+   if (finish) {
+      smrsim_zone_set_wp(zone_idx, num_sectors_zone());
+      smrsim_zone_set_cond(zone_idx, Z_COND_FULL);
+   } else {
+      smrsim_zone_set_wp(zone_idx, 0);
+      if (zone_type[zone_idx] == Z_TYPE_SEQUENTIAL) {
+         smrsim_zone_set_cond(zone_idx, Z_COND_EMPTY);
+      } 
+   }
+   smrsim_flight_reset(zone_idx, zone_wp[zone_idx]);
+   smrsim_zlock_release(zmask);
+   up_read(&smrsim_zone_lock);
+   trace_smrsim_gen_evt("dm-smrsim", finish ? "zone finished" : "zone wp reset");
+   return 0;
+}
+
+int smrsim_blkdev_reset_zone_ptr(sector_t start_sector)
+{
+   printk(KERN_INFO "smrsim: %s: called.\n", __FUNCTION__);
+   return smrsim_zone_wp_op(start_sector, false);
+}
+EXPORT_SYMBOL(smrsim_blkdev_reset_zone_ptr);
+
+int smrsim_get_zone_wp(struct smrsim_zone_wpinfo *wpinfo)
+{
+   __u32 zone_idx = wpinfo->zone_idx;
+   unsigned long zmask;
+
+   down_read(&smrsim_zone_lock);
+   if (SMR_NUMZONES <= zone_idx) {
+      up_read(&smrsim_zone_lock);
+      printk(KERN_ERR "smrsim: %s zone index is out of range\n", __FUNCTION__);  
+      return -EINVAL;
+   }
+   zmask = smrsim_zlock_mask(zone_idx, zone_idx);
+   smrsim_zlock_acquire(zmask);
+   smrsim_flight_sync(zone_idx);
+   wpinfo->swp = zone_wp[zone_idx];
+   wpinfo->dwp = smrsim_flight_durable(zone_idx, wpinfo->swp, &wpinfo->inflight);
+   smrsim_zlock_release(zmask);
+   up_read(&smrsim_zone_lock);
+   return 0;
+}
+EXPORT_SYMBOL(smrsim_get_zone_wp);
+
+/*
+ * Rule violation events
+ *
+ * Every violation is recorded as a struct smrsim_evt in a ring of the
+ * cpu it happened on, rather than printed. A ring has a single producer,
+ * its cpu with irqs off, and a single consumer, the reader of the
+ * smrsim_evt misc device, so head and tail are handed over with
+ * acquire/release and no lock. A full ring drops the event. dmesg only
+ * gets a rate limited summary.
+ */
+#define SMR_EVT_RING_SIZE  1024   /* events per cpu, power of 2 */
+
+struct smrsim_evt_ring {
+   unsigned long     head;        /* written by the owning cpu */
+   unsigned long     tail;        /* written by the reader     */
+   __u64             logged;
+   __u64             dropped;
+   struct smrsim_evt evt[SMR_EVT_RING_SIZE];
+};
+
+static struct smrsim_evt_ring **smrsim_evt_rings = NULL;
+static DEFINE_MUTEX(smrsim_evt_lock);
+static DEFINE_RATELIMIT_STATE(smrsim_evt_rs, 5 * HZ, 1);
+
+static void smrsim_evt_summary(struct smrsim_evt *evt)
+{
+   __u64 logged  = 0;
+   __u64 dropped = 0;
+   int   cpu;
+
+   for_each_possible_cpu(cpu) {
+      logged  += ACCESS_ONCE(smrsim_evt_rings[cpu]->logged);
+      dropped += ACCESS_ONCE(smrsim_evt_rings[cpu]->dropped);
+   }
+   printk(KERN_ERR "smrsim: %llu rule violations, %llu not recorded. last: zone %u lba %llu sectors %u err %d\n",
+          logged, dropped, evt->zone_idx, evt->lba, evt->len, evt->err);
+}
+
+static void smrsim_evt_log(__u32 zone_idx,
+                           __u64 lba,
+                           sector_t bio_sectors,
+                           __u32 uerr)
+{
+   struct smrsim_evt_ring *ring;
+   struct smrsim_evt      *evt;
+   struct smrsim_evt       last;
+   unsigned long           flags;
+   unsigned long           head;
+
+   if (!smrsim_evt_rings) {
+      return;
+   }
+   last.ts       = local_clock();
+   last.lba      = lba;
+   last.len      = bio_sectors;
+   last.zone_idx = zone_idx;
+   last.err      = (__s32)uerr;
+   local_irq_save(flags);
+   last.cpu      = smp_processor_id();
+   ring = smrsim_evt_rings[last.cpu];
+   head = ring->head;
+   ring->logged++;
+   if (head - smp_load_acquire(&ring->tail) >= SMR_EVT_RING_SIZE) {
+      ring->dropped++;
+   } else {
+      evt = &ring->evt[head & (SMR_EVT_RING_SIZE - 1)];
+      *evt = last;
+      smp_store_release(&ring->head, head + 1);
+   }
+   local_irq_restore(flags);
+   if (__ratelimit(&smrsim_evt_rs)) {
+      smrsim_evt_summary(&last);
+   }
+}
+
+static ssize_t smrsim_evt_read(struct file *file,
+                               char __user *buf,
+                               size_t count,
+                               loff_t *ppos)
+{
+   struct smrsim_evt_ring *ring;
+   unsigned long           head;
+   unsigned long           tail;
+   unsigned long           num;
+   size_t                  done = 0;
+   int                     cpu;
+
+   if (count < sizeof(struct smrsim_evt)) {
+      return -EINVAL;
+   }
+   mutex_lock(&smrsim_evt_lock);
+   for_each_possible_cpu(cpu) {
+      ring = smrsim_evt_rings[cpu];
+      head = smp_load_acquire(&ring->head);
+      tail = ring->tail;
+      while ((tail != head) && (count - done >= sizeof(struct smrsim_evt))) {
+         num = min(head - tail, SMR_EVT_RING_SIZE - (tail & (SMR_EVT_RING_SIZE - 1)));
+         num = min(num, (unsigned long)((count - done) / sizeof(struct smrsim_evt)));
+         if (copy_to_user(buf + done, &ring->evt[tail & (SMR_EVT_RING_SIZE - 1)],
+                          num * sizeof(struct smrsim_evt))) {
+            mutex_unlock(&smrsim_evt_lock);
+            return done ? done : -EFAULT;
+         }
+         done += num * sizeof(struct smrsim_evt);
+         tail += num;
+         smp_store_release(&ring->tail, tail);
+      }
+   }
+   mutex_unlock(&smrsim_evt_lock);
+   return done;
+}
+
+static const struct file_operations smrsim_evt_fops = {
+   .owner  = THIS_MODULE,
+   .read   = smrsim_evt_read,
+   .llseek = noop_llseek,
+};
+
+static struct miscdevice smrsim_evt_dev = {
+   .minor = MISC_DYNAMIC_MINOR,
+   .name  = "smrsim_evt",
+   .fops  = &smrsim_evt_fops,
+};
+
+static void smrsim_evt_exit(void)
+{
+   int cpu;
+
+   if (!smrsim_evt_rings) {
+      return;
+   }
+   misc_deregister(&smrsim_evt_dev);
+   for_each_possible_cpu(cpu) {
+      vfree(smrsim_evt_rings[cpu]);
+   }
+   kfree(smrsim_evt_rings);
+   smrsim_evt_rings = NULL;
+}
+
+/*
+ * Violations are still checked without the rings, just not recorded.
+ */
+static int smrsim_evt_init(void)
+{
+   struct smrsim_evt_ring **rings;
+   int cpu;
+
+   rings = kzalloc(nr_cpu_ids * sizeof(struct smrsim_evt_ring *), GFP_KERNEL);
+   if (!rings) {
+      return -ENOMEM;
+   }
+   for_each_possible_cpu(cpu) {
+      rings[cpu] = vzalloc(sizeof(struct smrsim_evt_ring));
+      if (!rings[cpu]) {
+         goto nomem;
+      }
+   }
+   if (misc_register(&smrsim_evt_dev)) {
+      goto nomem;
+   }
+   smrsim_evt_rings = rings;
+   return 0;
+   nomem:
+   for_each_possible_cpu(cpu) {
+      vfree(rings[cpu]);
+   }
+   kfree(rings);
+   return -ENOMEM;
+}
+
+/*
+ * /dev/smrsim_zones maps the zone map of the current table read only.
+ */
+static int smrsim_zmap_mmap(struct file *file,
+                            struct vm_area_struct *vma)
+{
+   unsigned long size = vma->vm_end - vma->vm_start;
+   int ret;
+
+   if (vma->vm_flags & VM_WRITE) {
+      return -EPERM;
+   }
+   #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+   vm_flags_clear(vma, VM_MAYWRITE);
+   #else
+   vma->vm_flags &= ~VM_MAYWRITE;
+   #endif
+   mutex_lock(&smrsim_zmap_lock);
+   if (!zone_zmap) {
+      ret = -ENODEV;
+   } else if ((vma->vm_pgoff << PAGE_SHIFT) + size >
+              PAGE_ALIGN((1 + zone_zmap->pages) * SMRSIM_ZMAP_PAGE)) {
+      ret = -EINVAL;
+   } else {
+      ret = remap_vmalloc_range(vma, zone_zmap, vma->vm_pgoff);
+   }
+   mutex_unlock(&smrsim_zmap_lock);
+   return ret;
+}
+
+static const struct file_operations smrsim_zmap_fops = {
+   .owner  = THIS_MODULE,
+   .mmap   = smrsim_zmap_mmap,
+   .llseek = noop_llseek,
+};
+
+static struct miscdevice smrsim_zmap_dev = {
+   .minor = MISC_DYNAMIC_MINOR,
+   .name  = "smrsim_zones",
+   .fops  = &smrsim_zmap_fops,
+};
+static int smrsim_zmap_registered = 0;
+
+static void smrsim_zmap_exit(void)
+{
+   if (smrsim_zmap_registered) {
+      misc_deregister(&smrsim_zmap_dev);
+      smrsim_zmap_registered = 0;
+   }
+}
+
+static int smrsim_zmap_init(void)
+{
+   if (misc_register(&smrsim_zmap_dev)) {
+      return -ENODEV;
+   }
+   smrsim_zmap_registered = 1;
+   return 0;
+}
+
+void smrsim_log_error(__u32 zone_idx,
+                      __u64 lba,
+                      sector_t bio_sectors,
+                      __u32 uerr)
+{
+   smrsim_evt_log(zone_idx, lba, bio_sectors, uerr);
+   switch(uerr)
+   {
+      case SMR_ERR_READ_BORDER:
+      case SMR_ERR_READ_POINTER: 
+         smrsim_dbg_rerr = uerr;
+         break;
+      case SMR_ERR_WRITE_RO:
+      case SMR_ERR_WRITE_POINTER:
+      case SMR_ERR_WRITE_ALIGN:
+      case SMR_ERR_WRITE_BORDER:
+      case SMR_ERR_WRITE_FULL:
+         smrsim_dbg_werr = uerr;
+         break;
+   }
+   if (smrsim_dbg_log_enabled) {
+      printk(KERN_DEBUG "%s: zone:%u lba:%llu sectors:%llu err:%d\n", __FUNCTION__,
+             zone_idx, lba, (unsigned long long)bio_sectors, (int)uerr);
+   }
+}
+
+/*
+ * Out of policy penalty
+ *
+ * Rather than sleeping in the map path, a bio passed under an out of
+ * policy flag is remapped and held on the device delay list. A timer
+ * kicks the delay worker which submits the bios whose penalty expired,
+ * so unrelated IO keeps flowing while the offender waits.
+ */
+#ifdef SMRSIM_BLK_ZONED
+static void smrsim_delay_timer(struct timer_list *t)
+{
+   struct smrsim_c *c = from_timer(c, t, delay_timer);
+#else
+static void smrsim_delay_timer(unsigned long data)
+{
+   struct smrsim_c *c = (struct smrsim_c *)data;
+#endif
+
+   queue_work(c->delay_wq, &c->delay_work);
+}
+
+static void smrsim_delay_release(struct smrsim_c *c,
+                                 bool all)
+{
+   struct smrsim_bio *sb;
+   struct smrsim_bio *next;
+   struct bio_list    bios;
+   struct bio        *bio;
+   unsigned long      expires = 0;
+
+   bio_list_init(&bios);
+   spin_lock(&c->delay_lock);
+   list_for_each_entry_safe(sb, next, &c->delay_list, list) {
+      if (all || time_after_eq(jiffies, sb->expires)) {
+         list_del(&sb->list);
+         bio_list_add(&bios, sb->bio);
+      } else if (!expires || time_before(sb->expires, expires)) {
+         expires = sb->expires;
+      }
+   }
+   if (expires && !c->draining) {
+      mod_timer(&c->delay_timer, expires);
+   }
+   spin_unlock(&c->delay_lock);
+   while ((bio = bio_list_pop(&bios))) {
+      smrsim_bio_submit(bio);
+   }
+}
+
+static void smrsim_delay_flush(struct work_struct *work)
+{
+   struct smrsim_c *c = container_of(work, struct smrsim_c, delay_work);
+
+   smrsim_delay_release(c, false);
+}
+
+/*
+ * Returns false, the bio not held, while the target is draining.
+ */
+static bool smrsim_delay_bio(struct smrsim_c *c,
+                             struct bio *bio,
+                             unsigned int penalty)
+{
+   struct smrsim_bio *sb = dm_per_bio_data(bio, sizeof(struct smrsim_bio));
+
+   sb->bio = bio;
+   sb->expires = jiffies + msecs_to_jiffies(penalty);
+   spin_lock(&c->delay_lock);
+   if (c->draining) {
+      spin_unlock(&c->delay_lock);
+      return false;
+   }
+   list_add_tail(&sb->list, &c->delay_list);
+   if (!timer_pending(&c->delay_timer) ||
+       time_before(sb->expires, c->delay_timer.expires)) {
+      mod_timer(&c->delay_timer, sb->expires);
+   }
+   spin_unlock(&c->delay_lock);
+   return true;
+}
+
+/*
+ * Write reorder window
+ *
+ * With the reorder feature a write to a sequential zone landing ahead
+ * of the WP, but within reorder_sectors of it, is held instead of
+ * failing with SMR_ERR_WRITE_POINTER, as zone write plugging would do.
+ * Held writes are kept in lba order on the reorder list and checked
+ * again as soon as a write moves the WP up to them; one still held
+ * after reorder_ms is checked as it is, so it fails or passes out of
+ * policy. Holding a write needs the zone lock so a write moving the WP
+ * can't miss it; lock order is zone lock, reorder_lock.
+ */
+static int smrsim_map_bio(struct dm_target *ti,
+                          struct bio *bio,
+                          bool reorder);
+
+#ifdef SMRSIM_BLK_ZONED
+static void smrsim_reorder_timer(struct timer_list *t)
+{
+   struct smrsim_c *c = from_timer(c, t, reorder_timer);
+#else
+static void smrsim_reorder_timer(unsigned long data)
+{
+   struct smrsim_c *c = (struct smrsim_c *)data;
+#endif
+
+   queue_work(c->delay_wq, &c->reorder_work);
+}
+
+/*
+ * Hold a write at lba ahead of the WP. Caller holds smrsim_zone_lock
+ * shared.
+ */
+static bool smrsim_reorder_hold(struct smrsim_c *c,
+                                struct bio *bio,
+                                __u64 lba)
+{
+   struct smrsim_bio *sb = dm_per_bio_data(bio, sizeof(struct smrsim_bio));
+   struct smrsim_bio *pos;
+   struct list_head  *at;
+   sector_t           bio_sectors = bio_sectors(bio);
+   unsigned long      zmask;
+   __u32              zone_idx;
+   __u64              wlba;
+   bool               held = false;
+
+   zone_idx = lba >> SMR_BLOCK_SIZE_SHIFT >> SMR_ZONE_SIZE_SHIFT;
+   if (!bio_sectors || (SMR_NUMZONES <= zone_idx)) {
+      return false;
+   }
+   zmask = smrsim_zlock_mask(zone_idx, zone_idx);
+   smrsim_zlock_acquire(zmask);
+   smrsim_flight_sync(zone_idx);
+   wlba = zone_idx_lba(zone_idx) + zone_wp[zone_idx];
+   if ((zone_type[zone_idx] != Z_TYPE_SEQUENTIAL) || (lba <= wlba) ||
+       ((lba + bio_sectors) > (wlba + c->reorder_sectors)) ||
+       ((lba + bio_sectors) > (zone_idx_lba(zone_idx) + num_sectors_zone()))) {
+      goto out;
+   }
+   sb->bio = bio;
+   sb->lba = lba;
+   sb->expires = jiffies + msecs_to_jiffies(c->reorder_ms);
+   spin_lock(&c->reorder_lock);
+   if (c->draining) {
+      spin_unlock(&c->reorder_lock);
+      goto out;
+   }
+   at = &c->reorder_list;
+   list_for_each_entry_reverse(pos, &c->reorder_list, list) {
+      if (pos->lba <= lba) {
+         at = &pos->list;
+         break;
+      }
+   }
+   list_add(&sb->list, at);
+   c->reorder_queued++;
+   c->reorder_held++;
+   if (!timer_pending(&c->reorder_timer) ||
+       time_before(sb->expires, c->reorder_timer.expires)) {
+      mod_timer(&c->reorder_timer, sb->expires);
+   }
+   spin_unlock(&c->reorder_lock);
+   held = true;
+   out:
+   smrsim_zlock_release(zmask);
+   return held;
+}
+
+static void smrsim_reorder_unlink(struct smrsim_c *c,
+                                  struct smrsim_bio *sb)
+{
+   list_del(&sb->list);
+   c->reorder_queued--;
+   c->reorder_wait += jiffies - (sb->expires - msecs_to_jiffies(c->reorder_ms));
+}
+
+static void smrsim_reorder_dispatch(struct dm_target *ti,
+                                    struct bio *bio)
+{
+   int ret = smrsim_map_bio(ti, bio, false);
+
+   if (ret == DM_MAPIO_REMAPPED) {
+      smrsim_bio_submit(bio);
+   } else if (ret < 0) {
+      smrsim_bio_endio(bio, -EIO);
+   }
+}
+
+/*
+ * Dispatch the held writes the WP of the zone holding lba has reached.
+ */
+static void smrsim_reorder_release(struct dm_target *ti,
+                                   __u64 lba)
+{
+   struct smrsim_c   *c = ti->private;
+   struct smrsim_bio *sb;
+   struct bio        *bio;
+   unsigned long      zmask;
+   __u32              zone_idx;
+   __u64              wlba;
+
+   while (ACCESS_ONCE(c->reorder_queued)) {
+      bio = NULL;
+      down_read(&smrsim_zone_lock);
+      zone_idx = lba >> SMR_BLOCK_SIZE_SHIFT >> SMR_ZONE_SIZE_SHIFT;
+      if (SMR_NUMZONES <= zone_idx) {
+         up_read(&smrsim_zone_lock);
+         break;
+      }
+      zmask = smrsim_zlock_mask(zone_idx, zone_idx);
+      smrsim_zlock_acquire(zmask);
+      wlba = zone_idx_lba(zone_idx) + zone_wp[zone_idx];
+      spin_lock(&c->reorder_lock);
+      list_for_each_entry(sb, &c->reorder_list, list) {
+         if (sb->lba > wlba) {
+            break;
+         }
+         if (sb->lba == wlba) {
+            smrsim_reorder_unlink(c, sb);
+            bio = sb->bio;
+            break;
+         }
+      }
+      spin_unlock(&c->reorder_lock);
+      smrsim_zlock_release(zmask);
+      up_read(&smrsim_zone_lock);
+      if (!bio) {
+         break;
+      }
+      smrsim_reorder_dispatch(ti, bio);
+   }
+}
+
+/*
+ * Check the held writes whose window expired, or all of them. sb is
+ * per-bio data, gone once dispatch completes the bio, so its fields are
+ * read first. As in smrsim_map_bio(), the bio is mapped and submitted,
+ * then the writes behind it are released.
+ */
+static void smrsim_reorder_expire(struct smrsim_c *c,
+                                  bool all)
+{
+   struct smrsim_bio *sb;
+   struct smrsim_bio *next;
+   struct list_head   expired;
+   struct bio        *bio;
+   unsigned long      expires = 0;
+   __u64              lba;
+
+   INIT_LIST_HEAD(&expired);
+   spin_lock(&c->reorder_lock);
+   list_for_each_entry_safe(sb, next, &c->reorder_list, list) {
+      if (all || time_after_eq(jiffies, sb->expires)) {
+         smrsim_reorder_unlink(c, sb);
+         list_add_tail(&sb->list, &expired);
+         c->reorder_expired++;
+      } else if (!expires || time_before(sb->expires, expires)) {
+         expires = sb->expires;
+      }
+   }
+   if (expires && !c->draining) {
+      mod_timer(&c->reorder_timer, expires);
+   }
+   spin_unlock(&c->reorder_lock);
+   list_for_each_entry_safe(sb, next, &expired, list) {
+      list_del(&sb->list);
+      bio = sb->bio;
+      lba = sb->lba;
+      smrsim_reorder_dispatch(c->ti, bio);
+      smrsim_reorder_release(c->ti, lba);
+   }
+}
+
+static void smrsim_reorder_flush(struct work_struct *work)
+{
+   struct smrsim_c *c = container_of(work, struct smrsim_c, reorder_work);
+
+   smrsim_reorder_expire(c, false);
+}
+
+static void smrsim_drain_set(struct smrsim_c *c,
+                             bool draining)
+{
+   spin_lock(&c->delay_lock);
+   spin_lock(&c->reorder_lock);
+   c->draining = draining;
+   spin_unlock(&c->reorder_lock);
+   spin_unlock(&c->delay_lock);
+}
+
+/*
+ * Dispatch every held bio. Once draining is set the workers can't re-arm
+ * the timers, so after the flush and del_timer_sync() neither timer can
+ * fire again; a work item the last timer queued finds the lists empty.
+ */
+static void smrsim_drain(struct smrsim_c *c)
+{
+   smrsim_drain_set(c, true);
+   flush_workqueue(c->delay_wq);
+   del_timer_sync(&c->reorder_timer);
+   del_timer_sync(&c->delay_timer);
+   smrsim_reorder_expire(c, true);
+   smrsim_delay_release(c, true);
+}
+
+/*
+ * Optional table features:
+ *
+ *    <dev> <start> [<#feature args> <feature arg>*]
+ *
+ *    zone_split             - dm core splits bios at zone boundaries
+ *    reorder <bytes> <ms>   - hold writes up to <bytes> ahead of the WP
+ *                             for up to <ms> to reorder them
+ *    journal                - log WP changes, checkpoint the image rarely
+ *    pstore_dirty <n>       - write metadata back once n pages are dirty
+ *    pstore_age <ms>        - write a change back within ms (default 1000)
+ *    pstore_flush           - write metadata back on a host flush or FUA
+ *    pstore_sync            - commit metadata before a host flush or FUA
+ *                             write completes, and only then
+ *    pstore_compact         - write metadata in the compact format
+ */
+#define SMR_FEATURE_ARGS_MAX  12
+
+static int smrsim_parse_features(struct dm_arg_set *as,
+                                 struct smrsim_c *c,
+                                 struct dm_target *ti)
+{
+   static struct dm_arg _args[] = {
+      {0, SMR_FEATURE_ARGS_MAX, "dm-smrsim:error: invalid number of feature args"},
+   };
+   const char        *arg_name;
+   unsigned           argc;
+   int                ret;
+   unsigned long long bytes;
+   char               dummy;
+
+   if (!as->argc) {
+      return 0;
+   }
+   ret = dm_read_arg_group(_args, as, &argc, &ti->error);
+   if (ret) {
+      return ret;
+   }
+   while (argc) {
+      arg_name = dm_shift_arg(as);
+      argc--;
+      if (!strcasecmp(arg_name, "zone_split")) {
+         c->zone_split = true;
+         continue;
+      }
+      if (!strcasecmp(arg_name, "journal")) {
+         c->journal = true;
+         continue;
+      }
+      if (!strcasecmp(arg_name, "pstore_dirty") && (argc >= 1)) {
+         argc--;
+         if ((1 != sscanf(dm_shift_arg(as), "%u%c", &c->pstore_dirty, &dummy)) ||
+             !c->pstore_dirty) {
+            ti->error = "dm-smrsim:error: pstore_dirty needs a page count";
+            return -EINVAL;
+         }
+         continue;
+      }
+      if (!strcasecmp(arg_name, "pstore_age") && (argc >= 1)) {
+         argc--;
+         if ((1 != sscanf(dm_shift_arg(as), "%u%c", &c->pstore_age, &dummy)) ||
+             !c->pstore_age) {
+            ti->error = "dm-smrsim:error: pstore_age needs <ms>";
+            return -EINVAL;
+         }
+         continue;
+      }
+      if (!strcasecmp(arg_name, "pstore_flush")) {
+         c->pstore_flush = true;
+         continue;
+      }
+      if (!strcasecmp(arg_name, "pstore_sync")) {
+         c->pstore_sync = true;
+         continue;
+      }
+      if (!strcasecmp(arg_name, "pstore_compact")) {
+         c->pstore_compact = true;
+         continue;
+      }
+      if (!strcasecmp(arg_name, "reorder") && (argc >= 2)) {
+         argc -= 2;
+         if ((1 != sscanf(dm_shift_arg(as), "%llu%c", &bytes, &dummy)) ||
+             !bytes || (bytes & 4095) ||
+             (1 != sscanf(dm_shift_arg(as), "%u%c", &c->reorder_ms, &dummy)) ||
+             !c->reorder_ms) {
+            ti->error = "dm-smrsim:error: reorder needs 4k aligned <bytes> and <ms>";
+            return -EINVAL;
+         }
+         c->reorder_sectors = bytes >> SMR_SECTOR_SIZE_SHIFT_DEFAULT;
+         continue;
+      }
+      ti->error = "dm-smrsim:error: unrecognised feature argument";
+      return -EINVAL;
+   }
+   if (as->argc) {
+      ti->error = "dm-smrsim:error: too many arguments";
       return -EINVAL;
    }
-   zone_status[zone_idx].z_write_ptr_offset = 0;
-   if (zone_status[zone_idx].z_type == Z_TYPE_SEQUENTIAL) {
-      zone_status[zone_idx].z_conds = Z_COND_EMPTY;
-   } 
-   mutex_unlock(&smrsim_zone_lock);
-   trace_smrsim_gen_evt("dm-smrsim", "zone wp reset");
    return 0;
 }
-EXPORT_SYMBOL(smrsim_blkdev_reset_zone_ptr);
 
-void smrsim_log_error(struct bio* bio,
-                      __u32 uerr)
+/*
+ * In zone_split mode dm core never hands a bio crossing a zone boundary
+ * to smrsim_map(), so large sequential IO is checked zone by zone rather
+ * than failing as a border violation. Follow zone size changes.
+ */
+static int smrsim_zone_split_update(struct dm_target *ti)
 {
-   __u64 lba;
+   struct smrsim_c *c = ti->private;
 
-   if (!bio) {
-      printk(KERN_ERR "smrsim: null pointer passed through\n");
-      return;
-   }
-   #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-      lba = bio->bi_sector;
-   #else
-      lba = bio->bi_iter.bi_sector;
-   #endif
-   if (smrsim_dbg_log_enabled) {
-      switch(uerr)
-      {
-         case SMR_ERR_READ_BORDER:
-            printk(KERN_DEBUG "%s: lba:%llu SMR_ERR_READ_BORDER\n", __FUNCTION__, lba);
-            smrsim_dbg_rerr = uerr;
-            break;
-         case SMR_ERR_READ_POINTER: 
-            printk(KERN_DEBUG "%s: lba:%llu: SMR_ERR_READ_POINTER\n",__FUNCTION__, lba);
-            smrsim_dbg_rerr = uerr;
-            break;
-         case SMR_ERR_WRITE_RO:
-            printk(KERN_DEBUG "%s: lba:%llu: SMR_ERR_WRITE_RO\n", __FUNCTION__, lba);
-            smrsim_dbg_werr = uerr;
-            break;
-         case SMR_ERR_WRITE_POINTER :
-            printk(KERN_DEBUG "%s: lba:%llu: SMR_ERR_WRITE_POINTER\n",__FUNCTION__, lba);
-            smrsim_dbg_werr = uerr;
-            break;
-         case SMR_ERR_WRITE_ALIGN :
-            printk(KERN_DEBUG "%s: lba:%llu: SMR_ERR_WRITE_ALIGN\n", __FUNCTION__, lba);
-            smrsim_dbg_werr = uerr;
-            break;
-         case SMR_ERR_WRITE_BORDER:
-            printk(KERN_DEBUG "%s: lba:%llu: SMR_ERR_WRITE_BORDER\n", __FUNCTION__, lba);
-            smrsim_dbg_werr = uerr;
-            break;
-         case SMR_ERR_WRITE_FULL:
-            printk(KERN_DEBUG "%s: lba:%llu: SMR_ERR_WRITE_FULL\n", __FUNCTION__, lba);
-            smrsim_dbg_werr = uerr;
-            break;
-         default:
-            printk(KERN_DEBUG "%s: lba:%llu: UNKNOWN ERR=%u\n", __FUNCTION__, lba, uerr);
-      }
+   if (!c->zone_split) {
+      return 0;
    }
+   return dm_set_target_max_io_len(ti, num_sectors_zone());
 }
 
 static int smrsim_ctr(struct dm_target* ti, 
@@ -1176,6 +4066,9 @@ static int smrsim_ctr(struct dm_target* ti,
    int iRet;
    char dummy;
    struct smrsim_c* c = NULL;
+   struct dm_arg_set as;
+   const char *meta_path = NULL;
+   unsigned meta_argc;
    __u64 num;
    
    printk(KERN_INFO "%s called\n", __FUNCTION__);
@@ -1187,8 +4080,8 @@ static int smrsim_ctr(struct dm_target* ti,
       printk(KERN_ERR "smrsim:error: invalid device\n");
       return -EINVAL;
    }
-   if (2 != argc) {
-      ti->error = "dm-smrsim:error: invalid argument count; !=2";
+   if (2 > argc) {
+      ti->error = "dm-smrsim:error: invalid argument count; <2";
       return -EINVAL;
    }
    if (1 != sscanf(argv[1], "%llu%c", &tmp, &dummy)) {
@@ -1196,57 +4089,148 @@ static int smrsim_ctr(struct dm_target* ti,
       return -EINVAL;
    }
    trace_smrsim_ctr_evt(argv[0], tmp, "start");
-   c = kmalloc(sizeof(*c), GFP_KERNEL);
+   c = kzalloc(sizeof(*c), GFP_KERNEL);
    if (!c) {
       ti->error = "dm-smrsim:error: no enough memory";
       return -ENOMEM;
    }
    c->start = tmp;
+   as.argc = argc - 2;
+   as.argv = argv + 2;
+   /*
+    * An optional metadata device comes before the feature count.
+    */
+   if (as.argc && (1 != sscanf(as.argv[0], "%u%c", &meta_argc, &dummy))) {
+      meta_path = dm_shift_arg(&as);
+   }
+   iRet = smrsim_parse_features(&as, c, ti);
+   if (iRet) {
+      kfree(c);
+      return iRet;
+   }
    iRet = dm_get_device(ti, argv[0], dm_table_get_mode(ti->table), &c->dev);
    if (iRet) {
       ti->error = "dm-smrsim:error: device lookup failed";
       kfree(c);
       return iRet;
    }
+   if (meta_path) {
+      iRet = dm_get_device(ti, meta_path, dm_table_get_mode(ti->table), &c->meta_dev);
+      if (iRet) {
+         ti->error = "dm-smrsim:error: metadata device lookup failed";
+         goto bad;
+      }
+      if (smrsim_bdev_bytes(c->meta_dev->bdev) <
+          (SMR_PSTORE_SLOTS * SMR_PSTORE_SLOT + SMR_PSTORE_LOG)) {
+         ti->error = "dm-smrsim:error: metadata device is too small";
+         iRet = -EINVAL;
+         goto bad;
+      }
+   }
    if (ti->len > SMR_MAX_CAPACITY) {
       printk(KERN_ERR "smrsim:error: capacity %llu exceeds the maximum 10TB\n",
             (__u64)ti->len);
-      kfree(c);
-      return -EINVAL;
+      iRet = -EINVAL;
+      goto bad;
    }
    num = ti->len >> SMR_BLOCK_SIZE_SHIFT >> SMR_ZONE_SIZE_SHIFT;
+   if (!smrsim_pstore_fits(num)) {
+      ti->error = "dm-smrsim:error: zone table doesn't fit the persistence slot";
+      iRet = -EINVAL;
+      goto bad;
+   }
    if ((num << SMR_BLOCK_SIZE_SHIFT << SMR_ZONE_SIZE_SHIFT) != ti->len) {
-      printk(KERN_ERR "smrsim:error: total size must be zone size (256MB) aligned\n");
+      #ifdef SMRSIM_BLK_ZONED
+      /* the block layer wants whole zones on a zoned device */
+      ti->error = "dm-smrsim:error: total size isn't zone size aligned";
+      iRet = -EINVAL;
+      goto bad;
+      #else
+      printk(KERN_WARNING "smrsim: total size isn't zone size (256MB) aligned, the tail is unused\n");
+      #endif
    }
    if (ti->len < (1 << SMR_BLOCK_SIZE_SHIFT << SMR_ZONE_SIZE_SHIFT)) {
       printk(KERN_INFO "smrsim: capacity: %llu sectors\n", (__u64)ti->len);
       printk(KERN_ERR "smrsim:error: capacity is too small. The default config is multiple of 256MB\n"); 
-      kfree(c);
-      return -EINVAL;
+      iRet = -EINVAL;
+      goto bad;
    }
-   ti->num_flush_bios = ti->num_discard_bios = ti->num_write_same_bios = 1;
+   c->delay_wq = alloc_workqueue("smrsimd", WQ_MEM_RECLAIM, 0);
+   if (!c->delay_wq) {
+      ti->error = "dm-smrsim:error: cannot allocate penalty workqueue";
+      iRet = -ENOMEM;
+      goto bad;
+   }
+   INIT_WORK(&c->delay_work, smrsim_delay_flush);
+   #ifdef SMRSIM_BLK_ZONED
+   timer_setup(&c->delay_timer, smrsim_delay_timer, 0);
+   #else
+   setup_timer(&c->delay_timer, smrsim_delay_timer, (unsigned long)c);
+   #endif
+   INIT_LIST_HEAD(&c->delay_list);
+   spin_lock_init(&c->delay_lock);
+   INIT_WORK(&c->reorder_work, smrsim_reorder_flush);
+   #ifdef SMRSIM_BLK_ZONED
+   timer_setup(&c->reorder_timer, smrsim_reorder_timer, 0);
+   #else
+   setup_timer(&c->reorder_timer, smrsim_reorder_timer, (unsigned long)c);
+   #endif
+   INIT_LIST_HEAD(&c->reorder_list);
+   spin_lock_init(&c->reorder_lock);
+   c->ti = ti;
+   ti->num_flush_bios = ti->num_discard_bios = 1;
+   #if !defined(SMRSIM_BLK_ZONED) || LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+   ti->num_write_same_bios = 1;
+   #endif
+   ti->per_bio_data_size = sizeof(struct smrsim_bio);
    ti->private = c;
    smrsim_dbg_rerr = 0;
    smrsim_dbg_werr = 0;
    smrsim_dbg_log_enabled = 0;
-   mutex_init(&smrsim_zone_lock);
+   init_rwsem(&smrsim_zone_lock);
    mutex_init(&smrsim_ioct_lock);
+   smrsim_zlock_init();
+   smrsim_ptask.journal = c->journal;
+   smrsim_ptask.dirty_thresh = c->pstore_dirty;
+   smrsim_ptask.age_ms = c->pstore_age ? c->pstore_age : SMR_PSTORE_AGE;
+   smrsim_ptask.on_flush = c->pstore_flush;
+   smrsim_ptask.sync = c->pstore_sync;
+   smrsim_ptask.compact = c->pstore_compact;
    if (smrsim_persistence_thread(ti)) {
       printk(KERN_ERR "smrsim:error: metadata will not be persisted\n");
    }
+   smrsim_zone_split_update(ti);
    smrsim_single = 1;
    return 0;
+   bad:
+   if (c->meta_dev) {
+      dm_put_device(ti, c->meta_dev);
+   }
+   dm_put_device(ti, c->dev);
+   kfree(c);
+   return iRet;
 }
 
 static void smrsim_dtr(struct dm_target *ti)
 {
    struct smrsim_c *c = (struct smrsim_c*) ti->private;
 
+   smrsim_drain(c);
+   destroy_workqueue(c->delay_wq);
    kthread_stop(smrsim_ptask.pstore_thread);
-   mutex_destroy(&smrsim_zone_lock);
    mutex_destroy(&smrsim_ioct_lock);
+   if (c->meta_dev) {
+      dm_put_device(ti, c->meta_dev);
+   }
    dm_put_device(ti, c->dev);
    kfree(c);
+   smrsim_stat_free();
+   smrsim_flight_free();
+   smrsim_zone_tbl_free();
+   smrsim_pstore_dirty_free();
+   smrsim_pstore_stage_free();
+   vfree(smrsim_ptask.log);
+   smrsim_ptask.log = NULL;
    vfree(zone_state);
    smrsim_single = 0;
    printk(KERN_INFO "smrsim target destructed\n");
@@ -1260,13 +4244,12 @@ static sector_t smrsim_map_sector(struct dm_target *ti,
    return c->start + dm_target_offset(ti, bi_sector);
 }
 
-int smrsim_write_rule_check(struct bio *bio,
+int smrsim_write_rule_check(__u64 lba,
+                            __u64 size,
                             __u32 zone_idx, 
                             sector_t bio_sectors,
                             int policy_flag)
 {
-   __u64 lba;
-   __u64 size; 
    __u64 elba;
    __u32 rem;
    __u64 zlba;
@@ -1275,22 +4258,13 @@ int smrsim_write_rule_check(struct bio *bio,
    __u32 idx;
    __u32 eidx;
 
-   #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-      lba  = bio->bi_sector;
-      size = bio->bi_size;
-   #else
-      lba  = bio->bi_iter.bi_sector;
-      size =  bio->bi_iter.bi_size;
-   #endif
    rv = 0;
    elba   = lba + bio_sectors;
-   if (zone_status[zone_idx].z_type == Z_TYPE_SEQUENTIAL) {
+   if (zone_type[zone_idx] == Z_TYPE_SEQUENTIAL) {
       div_u64_rem(size, 4096, &rem);
       if (rem) {
-         printk(KERN_ERR "smrsim:error: %s size is not 4k aligned. zone_idx: %u\n", 
-            __FUNCTION__, zone_idx); 
-         zone_state->stats.zone_stats[zone_idx].out_of_policy_write_stats.unaligned_count++;
-         smrsim_log_error(bio, SMR_ERR_WRITE_ALIGN);
+         smrsim_stat_inc(zone_idx, SMR_STAT_W_UNALIGNED);
+         smrsim_log_error(zone_idx, lba, bio_sectors, SMR_ERR_WRITE_ALIGN);
          rv++;
          if (!policy_flag) {
             return SMR_ERR_WRITE_ALIGN;
@@ -1299,30 +4273,28 @@ int smrsim_write_rule_check(struct bio *bio,
    }
    z_size = num_sectors_zone();  
    zlba = zone_idx_lba(zone_idx);
-   if ((zone_status[zone_idx].z_type == Z_TYPE_SEQUENTIAL) &&
-      (zlba + zone_status[zone_idx].z_write_ptr_offset != lba)) {
+   if ((zone_type[zone_idx] == Z_TYPE_SEQUENTIAL) &&
+      (zlba + zone_wp[zone_idx] != lba)) {
       #ifdef SMRSIM_WP_RT
       if (smrsim_wp_reset_flag && (lba == zlba)) {
          smrsim_wp_reset_cnt++;
          printk(KERN_ERR "smrsim:error: rt reset pass: %s zone_idx.counter: %u.%u\n", 
             __FUNCTION__, zone_idx, smrsim_wp_reset_cnt);
-         zone_status[zone_idx].z_write_ptr_offset = 0;
+         smrsim_zone_set_wp(zone_idx, 0);
          goto hcerr;
       } 
       else if (smrsim_wp_adjust_flag && (lba > (zlba + 
-         zone_status[zone_idx].z_write_ptr_offset))) {
+         zone_wp[zone_idx]))) {
          smrsim_wp_adjust_cnt++;
-         zone_state->stats.zone_stats[zone_idx].out_of_policy_write_stats.not_on_swp_count++;
+         smrsim_stat_inc(zone_idx, SMR_STAT_W_NOT_ON_SWP);
          printk(KERN_ERR "smrsim:error: rt write ahead pass: zone_idx.counter: %u.%u\n",
             zone_idx, smrsim_wp_adjust_cnt);
-         zone_status[zone_idx].z_write_ptr_offset = lba - zlba;
+         smrsim_zone_set_wp(zone_idx, lba - zlba);
          goto hcerr; 
       }
       #endif
-      printk(KERN_ERR "smrsim:error: %s write isn't at wp: %u.%012llx.%08lx wp: %08x\n",
-         __FUNCTION__, zone_idx, lba, bio_sectors, zone_status[zone_idx].z_write_ptr_offset);
-      zone_state->stats.zone_stats[zone_idx].out_of_policy_write_stats.not_on_swp_count++;
-      smrsim_log_error(bio, SMR_ERR_WRITE_POINTER);
+      smrsim_stat_inc(zone_idx, SMR_STAT_W_NOT_ON_SWP);
+      smrsim_log_error(zone_idx, lba, bio_sectors, SMR_ERR_WRITE_POINTER);
       if (!policy_flag) {
          rv++;
          return SMR_ERR_WRITE_POINTER;
@@ -1333,9 +4305,9 @@ int smrsim_write_rule_check(struct bio *bio,
       rv++;
    }
    /* internal trace */
-   if (zone_status[zone_idx].z_type == Z_TYPE_CONVENTIONAL) {
+   if (zone_type[zone_idx] == Z_TYPE_CONVENTIONAL) {
       if (elba == (zone_idx_lba(zone_idx) + z_size)) { 
-         zone_status[zone_idx].z_write_ptr_offset = z_size;
+         smrsim_zone_set_wp(zone_idx, z_size);
          if (smrsim_dbg_log_enabled && printk_ratelimit()) {
             printk(KERN_DEBUG "smrsim: conventional zone fill up a zone\n");
             printk(KERN_DEBUG "smrsim: %s %u.%012llx.%08lx\n",
@@ -1343,16 +4315,16 @@ int smrsim_write_rule_check(struct bio *bio,
          }
          return 0;
       } else {
-         if ((elba > (zone_idx_lba(zone_idx) + zone_status[zone_idx].z_write_ptr_offset)) &&
+         if ((elba > (zone_idx_lba(zone_idx) + zone_wp[zone_idx])) &&
              (elba < (zone_idx_lba(zone_idx) + z_size))) {
-            zone_status[zone_idx].z_write_ptr_offset = elba - zone_idx_lba(zone_idx);
+            smrsim_zone_set_wp(zone_idx, elba - zone_idx_lba(zone_idx));
             if (smrsim_dbg_log_enabled && printk_ratelimit()) {
                printk(KERN_DEBUG "smrsim: conventional zone write ahead\n");
                printk(KERN_DEBUG "smrsim: %s %u.%012llx.%08lx\n",
                   __FUNCTION__, zone_idx, lba, bio_sectors);
             }
             return 0;
-         } else if (elba < (zone_idx_lba(zone_idx) + zone_status[zone_idx].z_write_ptr_offset)){
+         } else if (elba < (zone_idx_lba(zone_idx) + zone_wp[zone_idx])){
             if (smrsim_dbg_log_enabled && printk_ratelimit()) {
                printk(KERN_DEBUG "smrsim: conventional zone modify\n"); 
                printk(KERN_DEBUG "smrsim: %s %u.%012llx.%08lx\n",
@@ -1365,42 +4337,38 @@ int smrsim_write_rule_check(struct bio *bio,
    if ((elba > (zlba + z_size))) {
       #ifdef SMRSIM_WP_RT
       if (elba <= (zlba + 2 * z_size)) {
-         if ((zone_status[zone_idx].z_type == Z_TYPE_SEQUENTIAL) && 
-            (zone_status[zone_idx + 1].z_type == Z_TYPE_SEQUENTIAL) && 
+         if ((zone_type[zone_idx] == Z_TYPE_SEQUENTIAL) && 
+            (zone_type[zone_idx + 1] == Z_TYPE_SEQUENTIAL) && 
             ((zone_idx + 1) < SMR_NUMZONES) && 
-            ((zone_status[zone_idx].z_flag == SMR_BODR_CROSS_SEQ) || 
-            (zone_status[zone_idx].z_flag == SMR_BODR_CROSS_CUR)) &&
-            ((smrsim_wp_reset_flag == 1) || (zone_status[zone_idx + 1].z_write_ptr_offset == 0))) {
+            ((zone_flag[zone_idx] == SMR_BODR_CROSS_SEQ) || 
+            (zone_flag[zone_idx] == SMR_BODR_CROSS_CUR)) &&
+            ((smrsim_wp_reset_flag == 1) || (zone_wp[zone_idx + 1] == 0))) {
             printk(KERN_ERR "smrsim:error: research split: %u.%012llx.%08lx type: 0x%x\n",
-               zone_idx, lba, bio_sectors, zone_status[zone_idx].z_type);
-            zone_status[zone_idx].z_conds = Z_COND_FULL; 
-            zone_status[zone_idx].z_write_ptr_offset = z_size;
-            zone_status[zone_idx + 1].z_write_ptr_offset = elba - zlba - z_size;
-            zone_status[zone_idx + 1].z_conds = Z_COND_CLOSED;
-            zone_state->stats.zone_stats[zone_idx].out_of_policy_write_stats.span_zones_count++;
+               zone_idx, lba, bio_sectors, zone_type[zone_idx]);
+            smrsim_zone_set_cond(zone_idx, Z_COND_FULL); 
+            smrsim_zone_set_wp(zone_idx, z_size);
+            smrsim_zone_set_wp(zone_idx + 1, elba - zlba - z_size);
+            smrsim_zone_set_cond(zone_idx + 1, Z_COND_CLOSED);
+            smrsim_stat_inc(zone_idx, SMR_STAT_W_SPAN_ZONES);
             rv++;
             return 0;
          }
-      } else {
-         printk(KERN_ERR "smrsim:error: write across border more than one zone\n");
-      } 
+      }
       #endif
-      if (zone_status[zone_idx].z_type == Z_TYPE_SEQUENTIAL) {
-         printk(KERN_ERR "smrsim:error: write acrossed border: %u.%012llx.%08lx type: 0x%x\n",
-            zone_idx, lba, bio_sectors, zone_status[zone_idx].z_type);
-         zone_state->stats.zone_stats[zone_idx].out_of_policy_write_stats.span_zones_count++;
-         smrsim_log_error(bio, SMR_ERR_WRITE_BORDER);
+      if (zone_type[zone_idx] == Z_TYPE_SEQUENTIAL) {
+         smrsim_stat_inc(zone_idx, SMR_STAT_W_SPAN_ZONES);
+         smrsim_log_error(zone_idx, lba, bio_sectors, SMR_ERR_WRITE_BORDER);
          rv++;
          if (!policy_flag) {
             return SMR_ERR_WRITE_BORDER;
          }
       }
       eidx = elba >> SMR_BLOCK_SIZE_SHIFT >> SMR_ZONE_SIZE_SHIFT;
-      if (zone_status[zone_idx].z_type == Z_TYPE_CONVENTIONAL) {
+      if (zone_type[zone_idx] == Z_TYPE_CONVENTIONAL) {
          for (idx = zone_idx + 1; idx <= eidx; idx++) {
-            if (zone_status[idx].z_type != Z_TYPE_CONVENTIONAL) {
-               zone_state->stats.zone_stats[zone_idx].out_of_policy_write_stats.span_zones_count++;
-               printk(KERN_ERR "smrsim:error: write across CMR zone to SMR zone\n");
+            if (zone_type[idx] != Z_TYPE_CONVENTIONAL) {
+               smrsim_stat_inc(zone_idx, SMR_STAT_W_SPAN_ZONES);
+               smrsim_log_error(zone_idx, lba, bio_sectors, SMR_ERR_WRITE_BORDER);
                if (!policy_flag) {
                   return SMR_ERR_WRITE_BORDER;
                } else {
@@ -1410,21 +4378,21 @@ int smrsim_write_rule_check(struct bio *bio,
             }
          }
       }
-      if ((zone_status[zone_idx].z_type == Z_TYPE_CONVENTIONAL) || (policy_flag == 1)) {
+      if ((zone_type[zone_idx] == Z_TYPE_CONVENTIONAL) || (policy_flag == 1)) {
          for (idx = zone_idx; idx < eidx; idx++) {
-            zone_status[idx].z_write_ptr_offset = z_size;
-            if (zone_status[idx].z_type == Z_TYPE_CONVENTIONAL) {
-               zone_status[idx].z_conds = Z_COND_NO_WP; 
+            smrsim_zone_set_wp(idx, z_size);
+            if (zone_type[idx] == Z_TYPE_CONVENTIONAL) {
+               smrsim_zone_set_cond(idx, Z_COND_NO_WP); 
             } else {
-               zone_status[idx].z_conds = Z_COND_FULL;
+               smrsim_zone_set_cond(idx, Z_COND_FULL);
             } 
          }
-         zone_status[eidx].z_write_ptr_offset = (elba - zlba - z_size) % z_size;
-         if (zone_status[eidx].z_type == Z_TYPE_SEQUENTIAL) {
-            if (zone_status[eidx].z_write_ptr_offset != z_size) {
-               zone_status[eidx].z_conds = Z_COND_CLOSED;
+         smrsim_zone_set_wp(eidx, (elba - zlba - z_size) % z_size);
+         if (zone_type[eidx] == Z_TYPE_SEQUENTIAL) {
+            if (zone_wp[eidx] != z_size) {
+               smrsim_zone_set_cond(eidx, Z_COND_CLOSED);
             } else {
-               zone_status[eidx].z_conds = Z_COND_FULL;
+               smrsim_zone_set_cond(eidx, Z_COND_FULL);
             }
          }
          if (policy_flag == 1) {
@@ -1433,24 +4401,23 @@ int smrsim_write_rule_check(struct bio *bio,
          return 0;
       }
    }
-   if ((policy_flag == 1) && (zone_status[zone_idx].z_conds == Z_COND_FULL)) {
-      zone_status[zone_idx].z_write_ptr_offset = elba - zlba;
-      if (zone_status[zone_idx].z_write_ptr_offset == z_size) {
-         zone_status[zone_idx].z_conds = Z_COND_FULL; 
+   if ((policy_flag == 1) && (zone_cond[zone_idx] == Z_COND_FULL)) {
+      smrsim_zone_set_wp(zone_idx, elba - zlba);
+      if (zone_wp[zone_idx] == z_size) {
+         smrsim_zone_set_cond(zone_idx, Z_COND_FULL); 
       } else {
-         zone_status[zone_idx].z_conds = Z_COND_CLOSED; 
+         smrsim_zone_set_cond(zone_idx, Z_COND_CLOSED); 
       }      
    } else { 
-      trace_smrsim_zone_write_evt(zone_idx, zone_status[zone_idx].z_write_ptr_offset,
-         zone_status[zone_idx].z_write_ptr_offset + bio_sectors);
-
-      zone_status[zone_idx].z_write_ptr_offset =  
-         zone_status[zone_idx].z_write_ptr_offset + bio_sectors;
-      if (zone_status[zone_idx].z_type == Z_TYPE_SEQUENTIAL) {
-         if (zone_status[zone_idx].z_write_ptr_offset == z_size) {
-            zone_status[zone_idx].z_conds = Z_COND_FULL; 
+      trace_smrsim_zone_write_evt(zone_idx, zone_wp[zone_idx],
+         zone_wp[zone_idx] + bio_sectors);
+
+      smrsim_zone_set_wp(zone_idx, zone_wp[zone_idx] + bio_sectors);
+      if (zone_type[zone_idx] == Z_TYPE_SEQUENTIAL) {
+         if (zone_wp[zone_idx] == z_size) {
+            smrsim_zone_set_cond(zone_idx, Z_COND_FULL); 
          } else {
-            zone_status[zone_idx].z_conds = Z_COND_CLOSED;
+            smrsim_zone_set_cond(zone_idx, Z_COND_CLOSED);
          } 
       }
    }
@@ -1459,131 +4426,166 @@ int smrsim_write_rule_check(struct bio *bio,
       printk(KERN_INFO "smrsim write PASS\n");
    }
    if (rv && (policy_flag ==1)) {
-      printk(KERN_ERR "smrsim: out of policy passed rule violation: %u\n", rv); 
       return SMR_ERR_OUT_OF_POLICY;
    }
    return 0;
 }
 
-int smrsim_read_rule_check(struct bio *bio,
-                            __u32 zone_idx, 
-                            sector_t bio_sectors,
-                            int policy_flag)
+int smrsim_read_rule_check(__u64 lba,
+                           __u32 zone_idx, 
+                           sector_t bio_sectors,
+                           int policy_flag)
 {
-   __u64 lba;
    __u64 zlba;
    __u64 elba;
    __u32 rv;
 
-   #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-      lba = bio->bi_sector;
-   #else
-      lba = bio->bi_iter.bi_sector;
-   #endif
    rv = 0;
    elba   = lba + bio_sectors;
    zlba = zone_idx_lba(zone_idx);
    if (elba > (zlba + num_sectors_zone())) {
-      printk(KERN_ERR "smrsim:error: read across zone: %u.%012llx.%08lx\n",
-         zone_idx, lba, bio_sectors);
       rv++;
-      zone_state->stats.zone_stats[zone_idx].out_of_policy_read_stats.span_zones_count++;
-      smrsim_log_error(bio, SMR_ERR_READ_BORDER);
+      smrsim_stat_inc(zone_idx, SMR_STAT_R_SPAN_ZONES);
+      smrsim_log_error(zone_idx, lba, bio_sectors, SMR_ERR_READ_BORDER);
       if (!policy_flag) {
          return SMR_ERR_READ_BORDER;
       }
-      printk(KERN_ERR "smrsim:error: out of policy allowed pass\n");
    }
 
-   if (zone_status[zone_idx].z_type == Z_TYPE_CONVENTIONAL) {
+   if (zone_type[zone_idx] == Z_TYPE_CONVENTIONAL) {
       if (smrsim_dbg_log_enabled && printk_ratelimit()) {
          printk(KERN_INFO "smrsim: conventional zone skip wp check\n");
       }
       goto next;  
    }
-   trace_smrsim_zone_read_evt(zone_idx, zone_status[zone_idx].z_write_ptr_offset);   
+   trace_smrsim_zone_read_evt(zone_idx, zone_wp[zone_idx]);   
 
-   if (elba > (zlba + zone_status[zone_idx].z_write_ptr_offset)) {
-      if (printk_ratelimit()) {
-         printk(KERN_ERR "smrsim:error: %s read beyond wp: %u.%012llx.%08lx wp: %08x\n",
-            __FUNCTION__, zone_idx, lba, bio_sectors, zone_status[zone_idx].z_write_ptr_offset);
-      }
+   if (elba > (zlba + zone_wp[zone_idx])) {
       rv++;
-      zone_state->stats.zone_stats[zone_idx].out_of_policy_read_stats.beyond_swp_count++;
-      smrsim_log_error(bio, SMR_ERR_READ_POINTER);
+      smrsim_stat_inc(zone_idx, SMR_STAT_R_BEYOND_SWP);
+      smrsim_log_error(zone_idx, lba, bio_sectors, SMR_ERR_READ_POINTER);
       if (!policy_flag) {
          return SMR_ERR_READ_POINTER;
       }
-      printk(KERN_ERR "smrsim:error: out of policy allowed pass\n");
    }
    next:   
    if (smrsim_dbg_log_enabled && printk_ratelimit()) {
       printk(KERN_INFO "smrsim read PASS\n");
    }
    if (rv) {
-      printk(KERN_ERR "smrsim: out of policy passed rule violation: %u\n", rv); 
       return SMR_ERR_OUT_OF_POLICY;
    }
    return 0;
 }
 
-static bool smrsim_ptask_queue_ok(__u32 idx)
-{
-   __u32 qidx;
-   
-    for (qidx = 0; qidx < smrsim_ptask.stu_zone_idx_cnt; qidx++) {
-       if (abs(idx - (smrsim_ptask.stu_zone_idx[qidx]))
-          <= SMR_PSTORE_PG_EDG) {
-          return false;
-       }
-    }
-    return true;
-}
-
-static bool smrsim_ptask_gap_ok(__u32 idx)
-{
-   __u32 qidx;
-   
-    for (qidx = 0; qidx < smrsim_ptask.stu_zone_idx_cnt; qidx++) {
-       if (abs(idx - (smrsim_ptask.stu_zone_idx[qidx]))
-          <= SMR_PSTORE_PG_GAP * SMR_PSTORE_PG_EDG) {
-          return true;
-       }
-    }
-    return false;
-}
-
-int smrsim_map(struct dm_target *ti, 
-               struct bio *bio)
+/*
+ * Lockless read fast path
+ *
+ * A read which stays inside one zone, below its write pointer (or in a
+ * conventional zone), breaks no rule and touches no stats, so it only
+ * needs a consistent snapshot of the zone geometry and write pointer.
+ * Anything else - a violation, a racing reconfiguration, debug logging -
+ * returns false and the bio takes the locked path in smrsim_map().
+ */
+static bool smrsim_map_read_fast(struct dm_target *ti,
+                                 struct bio *bio)
 {
-   struct smrsim_c* c = ti->private;
-   int cdir = bio_data_dir(bio);
-
+   struct smrsim_c           *c = ti->private;
+   struct smrsim_zone_tbl    *zt;
+   seqlock_t                 *zl;
    sector_t bio_sectors = bio_sectors(bio);
-   int policy_rflag = 0;
-   int policy_wflag = 0;
-   int ret = 0;
-   unsigned int penalty;
+   unsigned cseq;
+   unsigned zseq;
    __u32 zone_idx;
+   __u32 wp;
    __u64 lba;
+   __u64 zlba;
+   __u64 elba;
+   __u8  type;
+   __u8  conds;
 
-   mutex_lock(&smrsim_zone_lock);
+   if (smrsim_dbg_log_enabled) {
+      return false;
+   }
    #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-   zone_idx = bio->bi_sector >> SMR_BLOCK_SIZE_SHIFT 
-                             >> SMR_ZONE_SIZE_SHIFT;
    lba = bio->bi_sector;
    #else
-   zone_idx = bio->bi_iter.bi_sector >> SMR_BLOCK_SIZE_SHIFT 
-                                     >> SMR_ZONE_SIZE_SHIFT;
    lba = bio->bi_iter.bi_sector;
    #endif
-
+   rcu_read_lock();
+   cseq = raw_seqcount_begin(&smrsim_conf_seq);
+   zone_idx = lba >> SMR_BLOCK_SIZE_SHIFT >> SMR_ZONE_SIZE_SHIFT;
+   zlba = zone_idx_lba(zone_idx);
+   zt = rcu_dereference(zone_tbl);
+   if (read_seqcount_retry(&smrsim_conf_seq, cseq) || !zt ||
+       zone_idx >= SMR_NUMZONES || zone_idx >= zt->num_zones) {
+      goto slow;
+   }
+   elba = lba + bio_sectors;
+   if (elba > (zlba + num_sectors_zone())) {
+      goto slow;
+   }
+   zl = &smrsim_zlock[zone_idx % SMR_ZONE_LOCK_NUM];
+   do {
+      zseq  = read_seqbegin(zl);
+      wp    = zt->wp[zone_idx];
+      type  = zt->type[zone_idx];
+      conds = zt->cond[zone_idx];
+   } while (read_seqretry(zl, zseq));
+   if (conds == Z_COND_OFFLINE) {
+      goto slow;
+   }
+   if ((type != Z_TYPE_CONVENTIONAL) && (elba > (zlba + wp))) {
+      goto slow;
+   }
+   if (read_seqcount_retry(&smrsim_conf_seq, cseq)) {
+      goto slow;
+   }
    trace_smrsim_block_io_evt("dm-smrsim", bio);
+   trace_smrsim_zone_read_evt(zone_idx, wp);
+   smrsim_dev_idle_update();
+   rcu_read_unlock();
+   smrsim_bio_set_dev(bio, c->dev->bdev);
+   if (bio_sectors)
+   #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+      bio->bi_sector =  c->start + dm_target_offset(ti, bio->bi_sector);
+   #else
+      bio->bi_iter.bi_sector =  c->start + dm_target_offset(ti, bio->bi_iter.bi_sector);
+   #endif
+   return true;
+   slow:
+   rcu_read_unlock();
+   return false;
+}
+
+/*
+ * Apply the zone rules to an IO of bio_sectors at lba. Shared by the bio
+ * and request based targets; the caller holds smrsim_zone_lock shared.
+ * Returns 0 to pass the IO, with *penalty set for an out of policy pass,
+ * or SMR_DM_IO_ERR to fail it. A passed write to a sequential zone is
+ * tracked in sb, if given, until it completes.
+ */
+static int smrsim_zone_io_check(int cdir,
+                                __u64 lba,
+                                sector_t bio_sectors,
+                                __u64 size,
+                                unsigned int *penalty,
+                                struct smrsim_bio *sb)
+{
+   int policy_rflag = 0;
+   int policy_wflag = 0;
+   int ret = 0;
+   unsigned long zmask = 0;
+   __u32 zone_idx;
+   __u32 swp;
+   __u32 nwp;
+
+   zone_idx = lba >> SMR_BLOCK_SIZE_SHIFT >> SMR_ZONE_SIZE_SHIFT;
+   *penalty = 0;
    smrsim_dev_idle_update();
 
    if (SMR_NUMZONES <= zone_idx) {
-      printk(KERN_ERR "smrsim: lba is out of range. zone_idx: %u\n", zone_idx);
-      smrsim_log_error(bio, SMR_ERR_OUT_RANGE);
+      smrsim_log_error(zone_idx, lba, bio_sectors, SMR_ERR_OUT_RANGE);
       goto nomap;
    }
    if (smrsim_dbg_log_enabled) {
@@ -1591,106 +4593,444 @@ int smrsim_map(struct dm_target *ti,
          (unsigned long long)bio_sectors);
    }
    if ((lba + bio_sectors) > (zone_idx_lba(zone_idx) + 2 * num_sectors_zone())) {
-      printk(KERN_ERR "smrsim:error: %s bio_sectors() is too large\n", __FUNCTION__);  
-      smrsim_log_error(bio, SMR_ERR_OUT_OF_POLICY);
+      smrsim_log_error(zone_idx, lba, bio_sectors, SMR_ERR_OUT_OF_POLICY);
       goto nomap;
    } 
-   if (zone_status[zone_idx].z_conds == Z_COND_OFFLINE) {
-      printk(KERN_ERR "smrsim:error: zone is offline. zone_idx: %u\n", zone_idx);  
-      smrsim_log_error(bio, SMR_ERR_ZONE_OFFLINE);
+   zmask = smrsim_zlock_mask(zone_idx, (lba + max_t(__u64, bio_sectors, 1) - 1)
+                                       >> SMR_BLOCK_SIZE_SHIFT >> SMR_ZONE_SIZE_SHIFT);
+   smrsim_zlock_acquire(zmask);
+   if (zone_cond[zone_idx] == Z_COND_OFFLINE) {
+      smrsim_log_error(zone_idx, lba, bio_sectors, SMR_ERR_ZONE_OFFLINE);
       goto nomap;
    }
-   bio->bi_bdev = c->dev->bdev;
+   smrsim_flight_sync(zone_idx);
    policy_rflag = zone_state->config.dev_config.out_of_policy_read_flag;
    policy_wflag = zone_state->config.dev_config.out_of_policy_write_flag;
    if (cdir == WRITE) {
       if (smrsim_dbg_log_enabled) {
          printk(KERN_DEBUG "smrsim: %s WRITE %u.%012llx:%08lx WP=%08x.\n", __FUNCTION__,
-                zone_idx, lba, bio_sectors, zone_status[zone_idx].z_write_ptr_offset);
+                zone_idx, lba, bio_sectors, zone_wp[zone_idx]);
       }
-      if ((zone_status[zone_idx].z_conds == Z_COND_RO) && !policy_wflag) {
-         printk(KERN_ERR "smrsim:error: zone is read only. zone_idx: %u\n", zone_idx);  
-         smrsim_log_error(bio, SMR_ERR_WRITE_RO);
+      if ((zone_cond[zone_idx] == Z_COND_RO) && !policy_wflag) {
+         smrsim_log_error(zone_idx, lba, bio_sectors, SMR_ERR_WRITE_RO);
          goto nomap;
       }
-      if ((zone_status[zone_idx].z_conds == Z_COND_FULL) &&
+      if ((zone_cond[zone_idx] == Z_COND_FULL) &&
           (lba != zone_idx_lba(zone_idx)) && !policy_wflag) {
-         printk(KERN_ERR "smrsim:error: zone is full. zone_idx: %u\n", zone_idx);
-         smrsim_log_error(bio, SMR_ERR_WRITE_FULL);
+         smrsim_log_error(zone_idx, lba, bio_sectors, SMR_ERR_WRITE_FULL);
          goto nomap;
       }
-      ret = smrsim_write_rule_check(bio, zone_idx, bio_sectors, policy_wflag);
+      swp = zone_wp[zone_idx];
+      ret = smrsim_write_rule_check(lba, size, zone_idx, bio_sectors, policy_wflag);
       if (ret) {
          if (policy_wflag == 1 && policy_rflag ==1) {
             goto mapped;
          }
-         penalty = 0;
+         *penalty = 0;
          if (policy_wflag == 1) {
-            penalty = zone_state->config.dev_config.w_time_to_rmw_zone;
+            *penalty = zone_state->config.dev_config.w_time_to_rmw_zone;
             trace_smrsim_bio_oop_write_check_evt("out of policy: bio write error pass",
-               policy_wflag, penalty, ret);
-            printk(KERN_ERR "smrsim:%s: write error passed: out of policy write flagged on\n", 
-               __FUNCTION__);
-            msleep_interruptible(penalty);
+               policy_wflag, *penalty, ret);
          } else {
             trace_smrsim_bio_write_check_evt("write error out of policy", policy_wflag, ret);
             goto nomap;
          } 
       }
-      smrsim_ptask.flag |= SMR_STATUS_CHANGE;
-      if (smrsim_ptask.stu_zone_idx_cnt == SMR_PSTORE_QDEPTH) {
-         smrsim_ptask.stu_zone_idx_gap = SMR_PSTORE_PG_GAP;
-      } else if (smrsim_ptask_queue_ok(zone_idx)) {
-         smrsim_ptask.stu_zone_idx[smrsim_ptask.stu_zone_idx_cnt] = zone_idx;
-         smrsim_ptask.stu_zone_idx_cnt++;
-         if (!smrsim_ptask_gap_ok(zone_idx)) {
-            smrsim_ptask.stu_zone_idx_gap++;  
-         }
+      nwp = zone_wp[zone_idx];
+      if ((zone_type[zone_idx] == Z_TYPE_SEQUENTIAL) && (nwp >= bio_sectors) &&
+          ((lba + bio_sectors) <= (zone_idx_lba(zone_idx) + num_sectors_zone()))) {
+         smrsim_flight_start(sb, zone_idx, swp, nwp - bio_sectors, nwp);
       }
    }
    else if (cdir == READ) {
       if (smrsim_dbg_log_enabled) {
          printk(KERN_DEBUG "smrsim: %s READ %u.%012llx:%08lx WP=%08x.\n", __FUNCTION__,
-                zone_idx, lba, bio_sectors, zone_status[zone_idx].z_write_ptr_offset);
+                zone_idx, lba, bio_sectors, zone_wp[zone_idx]);
       }
-      ret = smrsim_read_rule_check(bio, zone_idx, bio_sectors, policy_rflag);
+      ret = smrsim_read_rule_check(lba, zone_idx, bio_sectors, policy_rflag);
       if (ret) {
          if (policy_wflag == 1 && policy_rflag ==1) {
-            printk(KERN_ERR "smrsim: out of policy read passthrough applied\n");
             goto mapped;
          }
-         penalty = 0;
+         *penalty = 0;
          if (policy_rflag == 1) {
-            penalty = zone_state->config.dev_config.r_time_to_rmw_zone;
+            *penalty = zone_state->config.dev_config.r_time_to_rmw_zone;
             trace_smrsim_bio_oop_read_check_evt("out of policy: bio read error", policy_rflag,
-               penalty, ret);
-            if (printk_ratelimit()) {
-               printk(KERN_ERR "smrsim:%s: read error passed: out of policy read flagged on\n", 
-                  __FUNCTION__);
-            }
-            msleep_interruptible(penalty);
+               *penalty, ret);
          } else {
             trace_smrsim_bio_read_check_evt("read error out of policy", policy_rflag, ret);
             goto nomap;
          }
       }
    }
-   mapped:
-   if (bio_sectors(bio))
-   #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-      bio->bi_sector =  c->start + dm_target_offset(ti, bio->bi_sector);
-   #else
-      bio->bi_iter.bi_sector =  c->start + dm_target_offset(ti, bio->bi_iter.bi_sector);
-   #endif
-   mutex_unlock(&smrsim_zone_lock);
+   mapped:
+   smrsim_zlock_release(zmask);
+   return 0;
+   nomap:
+   smrsim_zlock_release(zmask);
+   return SMR_DM_IO_ERR;  
+}
+
+/*
+ * Check and remap a bio. With reorder set a write ahead of the WP may be
+ * held, and a passed write is submitted here, ahead of the held writes
+ * it releases.
+ */
+static int smrsim_map_bio(struct dm_target *ti,
+                          struct bio *bio,
+                          bool reorder)
+{
+   struct smrsim_c* c = ti->private;
+   struct smrsim_bio *sb = dm_per_bio_data(bio, sizeof(struct smrsim_bio));
+   int cdir = bio_data_dir(bio);
+   unsigned int penalty = 0;
+   __u64 lba;
+   int ret;
+
+   sb->tracked = false;
+   sb->synced = false;
+   if ((cdir == READ) && smrsim_map_read_fast(ti, bio)) {
+      return DM_MAPIO_REMAPPED;
+   }
+   trace_smrsim_block_io_evt("dm-smrsim", bio);
+   #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+   lba = bio->bi_sector;
+   #else
+   lba = bio->bi_iter.bi_sector;
+   #endif
+   reorder = reorder && (cdir == WRITE) && c->reorder_sectors;
+   down_read(&smrsim_zone_lock);
+   if (reorder && smrsim_reorder_hold(c, bio, lba)) {
+      up_read(&smrsim_zone_lock);
+      return DM_MAPIO_SUBMITTED;
+   }
+   #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+   ret = smrsim_zone_io_check(cdir, lba, bio_sectors(bio),
+                              bio->bi_size, &penalty, sb);
+   #else
+   ret = smrsim_zone_io_check(cdir, lba, bio_sectors(bio),
+                              bio->bi_iter.bi_size, &penalty, sb);
+   #endif
+   up_read(&smrsim_zone_lock);
+   if (ret) {
+      return ret;
+   }
+   smrsim_bio_set_dev(bio, c->dev->bdev);
+   if (bio_sectors(bio))
+   #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+      bio->bi_sector =  c->start + dm_target_offset(ti, bio->bi_sector);
+   #else
+      bio->bi_iter.bi_sector =  c->start + dm_target_offset(ti, bio->bi_iter.bi_sector);
+   #endif
+   if (penalty && smrsim_delay_bio(c, bio, penalty)) {
+      ret = DM_MAPIO_SUBMITTED;
+   } else {
+      ret = DM_MAPIO_REMAPPED;
+   }
+   if (reorder && ACCESS_ONCE(c->reorder_queued)) {
+      if (ret == DM_MAPIO_REMAPPED) {
+         smrsim_bio_submit(bio);
+         ret = DM_MAPIO_SUBMITTED;
+      }
+      smrsim_reorder_release(ti, lba);
+   }
+   return ret;
+}
+
+#ifdef SMRSIM_BLK_ZONED
+/*
+ * Zoned block device hooks
+ *
+ * io_hints makes the mapped device host managed with the current zone
+ * size, report_zones builds struct blk_zone from the zone table and
+ * zone management bios update the table rather than being remapped. The
+ * block layer reads the zones again when the table is resumed, so a
+ * zone size or count change needs a table reload.
+ */
+static __u8 smrsim_blk_zone_cond(__u8 cond)
+{
+   switch (cond) {
+      case Z_COND_NO_WP:
+         return BLK_ZONE_COND_NOT_WP;
+      case Z_COND_EMPTY:
+         return BLK_ZONE_COND_EMPTY;
+      case Z_COND_IMP_OPEN:
+         return BLK_ZONE_COND_IMP_OPEN;
+      case Z_COND_EXP_OPEN:
+         return BLK_ZONE_COND_EXP_OPEN;
+      case Z_COND_CLOSED:
+         return BLK_ZONE_COND_CLOSED;
+      case Z_COND_RO:
+         return BLK_ZONE_COND_READONLY;
+      case Z_COND_FULL:
+         return BLK_ZONE_COND_FULL;
+      default:
+         return BLK_ZONE_COND_OFFLINE;
+   }
+}
+
+/*
+ * The zones come from the table, not from the backing device, so there
+ * is nothing for dm_report_zones() to walk. Hand each one to the report
+ * callback the way it does: in mapped device sectors, moving next_sector
+ * past the zone.
+ */
+static int smrsim_report_zone(struct dm_target *ti,
+                              struct blk_zone *zone,
+                              struct dm_report_zones_args *args)
+{
+   zone->start += ti->begin;
+   zone->wp    += ti->begin;
+   args->next_sector = zone->start + zone->len;
+   return args->orig_cb(zone, args->zone_idx++, args->orig_data);
+}
+
+static int smrsim_report_zones(struct dm_target *ti,
+                               struct dm_report_zones_args *args,
+                               unsigned int nr_zones)
+{
+   struct blk_zone zone;
+   unsigned long zmask;
+   __u32 zone_idx;
+   __u32 end;
+   int ret = 0;
+
+   down_read(&smrsim_zone_lock);
+   zone_idx = dm_target_offset(ti, args->next_sector) >> SMR_BLOCK_SIZE_SHIFT
+                                                      >> SMR_ZONE_SIZE_SHIFT;
+   end = min_t(__u64, SMR_NUMZONES, (__u64)zone_idx + nr_zones);
+   for (; !ret && (zone_idx < end); zone_idx++) {
+      memset(&zone, 0, sizeof(struct blk_zone));
+      zone.start = zone_idx_lba(zone_idx);
+      zone.len   = num_sectors_zone();
+      #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+      zone.capacity = zone.len;
+      #endif
+      zmask = smrsim_zlock_mask(zone_idx, zone_idx);
+      smrsim_zlock_acquire(zmask);
+      zone.wp   = zone.start + zone_wp[zone_idx];
+      zone.cond = smrsim_blk_zone_cond(zone_cond[zone_idx]);
+      zone.type = (zone_type[zone_idx] == Z_TYPE_CONVENTIONAL) ?
+                  BLK_ZONE_TYPE_CONVENTIONAL : BLK_ZONE_TYPE_SEQWRITE_REQ;
+      smrsim_zlock_release(zmask);
+      ret = smrsim_report_zone(ti, &zone, args);
+   }
+   if (!ret && (zone_idx >= SMR_NUMZONES)) {
+      /* no zones past the last one, let the report end */
+      args->next_sector = ti->begin + ti->len;
+   }
+   up_read(&smrsim_zone_lock);
+   return ret;
+}
+
+static void smrsim_io_hints(struct dm_target *ti,
+                            struct queue_limits *limits)
+{
+   limits->zoned = BLK_ZONED_HM;
+   limits->chunk_sectors = num_sectors_zone();
+}
+
+/*
+ * There is no open zone limit to model, so open and close only succeed.
+ * The bio completes here, so end_io must find nothing in flight for it.
+ */
+static int smrsim_zone_mgmt(struct dm_target *ti,
+                            struct bio *bio)
+{
+   struct smrsim_bio *sb = dm_per_bio_data(bio, sizeof(struct smrsim_bio));
+   sector_t start = dm_target_offset(ti, bio->bi_iter.bi_sector);
+   int ret = 0;
+
+   sb->tracked = false;
+   sb->synced = false;
+   switch (bio_op(bio)) {
+      case REQ_OP_ZONE_RESET:
+         ret = smrsim_zone_wp_op(start, false);
+         break;
+      case REQ_OP_ZONE_FINISH:
+         ret = smrsim_zone_wp_op(start, true);
+         break;
+      case REQ_OP_ZONE_OPEN:
+      case REQ_OP_ZONE_CLOSE:
+         break;
+      default:
+         ret = -EOPNOTSUPP;
+         break;
+   }
+   smrsim_bio_endio(bio, ret);
+   return DM_MAPIO_SUBMITTED;
+}
+#endif
+
+int smrsim_map(struct dm_target *ti, 
+               struct bio *bio)
+{
+#ifdef SMRSIM_BLK_ZONED
+   if (op_is_zone_mgmt(bio_op(bio))) {
+      return smrsim_zone_mgmt(ti, bio);
+   }
+#endif
+   if (smrsim_bio_flush(bio) && smrsim_ptask.on_flush) {
+      smrsim_pstore_kick();
+   }
+   return smrsim_map_bio(ti, bio, true);
+}
+
+static int smrsim_bio_done(struct dm_target *ti,
+                           struct bio *bio,
+                           int error)
+{
+   struct smrsim_bio *sb = dm_per_bio_data(bio, sizeof(struct smrsim_bio));
+
+   if (sb->synced) {
+      return error;
+   }
+   if (sb->tracked) {
+      smrsim_flight_end(sb, error);
+   }
+   if (!error && smrsim_ptask.sync && smrsim_bio_flush(bio)) {
+      sb->synced = true;
+      smrsim_pstore_hold(bio);
+      return DM_ENDIO_INCOMPLETE;
+   }
+   return error;
+}
+
+#ifdef SMRSIM_BLK_ZONED
+static int smrsim_end_io(struct dm_target *ti,
+                         struct bio *bio,
+                         blk_status_t *error)
+{
+   int ret = smrsim_bio_done(ti, bio, blk_status_to_errno(*error));
+
+   if (ret == DM_ENDIO_INCOMPLETE) {
+      return ret;
+   }
+   *error = errno_to_blk_status(ret);
+   return DM_ENDIO_DONE;
+}
+#else
+static int smrsim_end_io(struct dm_target *ti,
+                         struct bio *bio,
+                         int error)
+{
+   return smrsim_bio_done(ti, bio, error);
+}
+#endif
+
+#ifndef SMRSIM_BLK_ZONED
+/*
+ * Request based target - smrsim-rq
+ *
+ * dm core merges bios into requests before they reach the target, so
+ * the zone rules run once per request against the same zone model as
+ * the bio target, guarded by the per-zone locks. Mapping runs in atomic
+ * context: a request is requeued while a reconfiguration holds
+ * smrsim_zone_lock, and the out of policy penalty isn't modeled - a
+ * passed request is dispatched at once. Requests can't be remapped to
+ * another sector, so the table must map sector 0 to sector 0. Writes
+ * aren't tracked in flight; the durable WP follows the submitted WP.
+ */
+static int smrsim_rq_check(struct request *rq)
+{
+   unsigned int penalty;
+   int ret;
+
+   if ((rq->cmd_flags & (REQ_FLUSH | REQ_FUA)) && smrsim_ptask.on_flush) {
+      smrsim_pstore_kick();
+   }
+   if ((rq->cmd_flags & REQ_FLUSH) || !blk_rq_sectors(rq)) {
+      return 0;
+   }
+   if (!down_read_trylock(&smrsim_zone_lock)) {
+      return DM_MAPIO_REQUEUE;
+   }
+   ret = smrsim_zone_io_check(rq_data_dir(rq), blk_rq_pos(rq), blk_rq_sectors(rq),
+                              blk_rq_bytes(rq), &penalty, NULL);
+   up_read(&smrsim_zone_lock);
+   return ret;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0)
+static int smrsim_map_rq(struct dm_target *ti,
+                         struct request *clone,
+                         union map_info *map_context)
+{
+   struct smrsim_c *c = ti->private;
+   int ret;
+
+   ret = smrsim_rq_check(clone);
+   if (ret) {
+      return ret;
+   }
+   clone->q = bdev_get_queue(c->dev->bdev);
+   clone->rq_disk = c->dev->bdev->bd_disk;
+   return DM_MAPIO_REMAPPED;
+}
+#else
+static int smrsim_clone_and_map_rq(struct dm_target *ti,
+                                   struct request *rq,
+                                   union map_info *map_context,
+                                   struct request **__clone)
+{
+   struct smrsim_c *c = ti->private;
+   struct request  *clone;
+   int ret;
+
+   ret = smrsim_rq_check(rq);
+   if (ret) {
+      return ret;
+   }
+   clone = blk_get_request(bdev_get_queue(c->dev->bdev), rq_data_dir(rq), GFP_ATOMIC);
+   if (IS_ERR(clone)) {
+      return DM_MAPIO_REQUEUE;
+   }
+   clone->bio = clone->biotail = NULL;
+   clone->rq_disk = c->dev->bdev->bd_disk;
+   *__clone = clone;
    return DM_MAPIO_REMAPPED;
-   nomap:
-   smrsim_ptask.flag |= SMR_STATS_CHANGE;
-   smrsim_ptask.sts_zone_idx = zone_idx;
-   mutex_unlock(&smrsim_zone_lock);
-   return SMR_DM_IO_ERR;  
 }
 
+static void smrsim_release_clone_rq(struct request *clone)
+{
+   blk_put_request(clone);
+}
+#endif
+
+static int smrsim_rq_ctr(struct dm_target* ti, 
+                         unsigned int argc,
+                         char** argv)
+{
+   unsigned long long tmp;
+   char dummy;
+
+   struct smrsim_c *c;
+   int ret;
+
+   if ((2 <= argc) && (1 == sscanf(argv[1], "%llu%c", &tmp, &dummy)) &&
+       (tmp || ti->begin)) {
+      ti->error = "dm-smrsim:error: request based target must map sector 0 to 0";
+      return -EINVAL;
+   }
+   ret = smrsim_ctr(ti, argc, argv);
+   if (ret) {
+      return ret;
+   }
+   c = ti->private;
+   if (c->reorder_sectors) {
+      smrsim_dtr(ti);
+      ti->error = "dm-smrsim:error: request based target doesn't support reorder";
+      return -EINVAL;
+   }
+   if (c->pstore_sync) {
+      smrsim_dtr(ti);
+      ti->error = "dm-smrsim:error: request based target doesn't support pstore_sync";
+      return -EINVAL;
+   }
+   return 0;
+}
+#endif
+
 static void smrsim_status(struct dm_target* ti, 
                           status_type_t type,
                           unsigned status_flags, 
@@ -1698,16 +5038,73 @@ static void smrsim_status(struct dm_target* ti,
                           unsigned maxlen)
 {
    struct smrsim_c* c   = ti->private;
+   unsigned         sz;
 
    switch(type)
    {
       case STATUSTYPE_INFO:
          result[0] = '\0';
+         if (c->reorder_sectors) {
+            spin_lock(&c->reorder_lock);
+            snprintf(result, maxlen, "%llu %llu %u %llu",
+               (unsigned long long)c->reorder_held,
+               (unsigned long long)c->reorder_expired, c->reorder_queued,
+               (unsigned long long)div_u64(c->reorder_wait * 1000, HZ));
+            spin_unlock(&c->reorder_lock);
+         }
          break;
 
       case STATUSTYPE_TABLE:
          snprintf(result, maxlen, "%s %llu", c->dev->name,
 	    (unsigned long long)c->start);
+         if (c->meta_dev) {
+            sz = strlen(result);
+            snprintf(result + sz, maxlen - sz, " %s", c->meta_dev->name);
+         }
+         if (c->zone_split || c->reorder_sectors || c->journal ||
+             c->pstore_dirty || c->pstore_age || c->pstore_flush ||
+             c->pstore_sync || c->pstore_compact) {
+            sz = strlen(result);
+            snprintf(result + sz, maxlen - sz, " %u",
+               (c->zone_split ? 1 : 0) + (c->reorder_sectors ? 3 : 0) +
+               (c->journal ? 1 : 0) + (c->pstore_dirty ? 2 : 0) +
+               (c->pstore_age ? 2 : 0) + (c->pstore_flush ? 1 : 0) +
+               (c->pstore_sync ? 1 : 0) + (c->pstore_compact ? 1 : 0));
+         }
+         if (c->zone_split) {
+            sz = strlen(result);
+            snprintf(result + sz, maxlen - sz, " zone_split");
+         }
+         if (c->journal) {
+            sz = strlen(result);
+            snprintf(result + sz, maxlen - sz, " journal");
+         }
+         if (c->pstore_dirty) {
+            sz = strlen(result);
+            snprintf(result + sz, maxlen - sz, " pstore_dirty %u", c->pstore_dirty);
+         }
+         if (c->pstore_age) {
+            sz = strlen(result);
+            snprintf(result + sz, maxlen - sz, " pstore_age %u", c->pstore_age);
+         }
+         if (c->pstore_flush) {
+            sz = strlen(result);
+            snprintf(result + sz, maxlen - sz, " pstore_flush");
+         }
+         if (c->pstore_sync) {
+            sz = strlen(result);
+            snprintf(result + sz, maxlen - sz, " pstore_sync");
+         }
+         if (c->pstore_compact) {
+            sz = strlen(result);
+            snprintf(result + sz, maxlen - sz, " pstore_compact");
+         }
+         if (c->reorder_sectors) {
+            sz = strlen(result);
+            snprintf(result + sz, maxlen - sz, " reorder %llu %u",
+               (unsigned long long)c->reorder_sectors << SMR_SECTOR_SIZE_SHIFT_DEFAULT,
+               c->reorder_ms);
+         }
          break;
    }
 }
@@ -1730,6 +5127,142 @@ static void smrsim_list_zone_status(struct smrsim_zone_status *ptr,
    }
 }
 
+/*
+ * Compose one zone status entry from the image and the zone table under
+ * its zone seqlock so that a query never returns a write pointer torn
+ * from its condition.
+ */
+static void smrsim_zone_copy(struct smrsim_zone_status *dst,
+                             __u32 zone_idx)
+{
+   seqlock_t *zl = &smrsim_zlock[zone_idx % SMR_ZONE_LOCK_NUM];
+   unsigned seq;
+
+   memcpy(dst, &zone_status[zone_idx], sizeof(struct smrsim_zone_status));
+   do {
+      seq = read_seqbegin(zl);
+      dst->z_write_ptr_offset = zone_wp[zone_idx];
+      dst->z_conds = zone_cond[zone_idx];
+      dst->z_type  = zone_type[zone_idx];
+      dst->z_flag  = zone_flag[zone_idx];
+   } while (read_seqretry(zl, seq));
+}
+
+/*
+ * Copy up to max zones in zone_idx..end-1 with at least criteria free
+ * sectors to ptr, in order. Buckets above the one of criteria match
+ * whole, its own is checked zone by zone. Sets *resume past the last
+ * zone scanned and returns the number copied.
+ */
+static __u32 smrsim_query_free(__u32 zone_idx,
+                               __u32 end,
+                               __u32 criteria,
+                               __u32 max,
+                               struct smrsim_zone_status *ptr,
+                               __u32 *resume)
+{
+   __u32 next[SMR_ZONE_BUCKETS];
+   __u32 low = fls(criteria);
+   __u32 last = end;
+   __u32 nr = 0;
+   __u32 idx;
+   __u32 bkt;
+   __u32 min;
+
+   for (bkt = low; bkt < SMR_ZONE_BUCKETS; bkt++) {
+      next[bkt] = find_next_bit(zone_fmap[bkt], end, zone_idx);
+   }
+   *resume = end;
+   while (nr < max) {
+      min = low;
+      for (bkt = low + 1; bkt < SMR_ZONE_BUCKETS; bkt++) {
+         if (next[bkt] < next[min]) {
+            min = bkt;
+         }
+      }
+      idx = next[min];
+      if (idx >= end) {
+         break;
+      }
+      next[min] = find_next_bit(zone_fmap[min], end, idx + 1);
+      if ((idx != last) && ((num_sectors_zone() - zone_wp[idx]) >= criteria)) {
+         smrsim_zone_copy(ptr + nr, idx);
+         last = idx;
+         nr++;
+         *resume = idx + 1;
+      }
+   }
+   if (nr < max) {
+      *resume = end;
+   }
+   return nr;
+}
+
+/*
+ * Copy up to max zones from zone_idx on in condition cond, and with a
+ * WP if written is set, to ptr. Sets *resume past the last zone scanned
+ * and returns the number copied.
+ */
+static __u32 smrsim_query_cond(__u32 zone_idx,
+                               __u8 cond,
+                               bool written,
+                               __u32 max,
+                               struct smrsim_zone_status *ptr,
+                               __u32 *resume)
+{
+   unsigned long *map = zone_cmap[cond & (SMR_ZONE_CONDS - 1)];
+   __u32 nr = 0;
+   __u32 idx;
+
+   *resume = SMR_NUMZONES;
+   for (idx = find_next_bit(map, SMR_NUMZONES, zone_idx);
+        (idx < SMR_NUMZONES) && (nr < max);
+        idx = find_next_bit(map, SMR_NUMZONES, idx + 1)) {
+      if ((zone_cond[idx] != cond) || (written && !zone_wp[idx])) {
+         continue;
+      }
+      smrsim_zone_copy(ptr + nr, idx);
+      nr++;
+      *resume = idx + 1;
+   }
+   if (nr < max) {
+      *resume = SMR_NUMZONES;
+   }
+   return nr;
+}
+
+/*
+ * Condition a negative criteria matches, and whether the zone must have
+ * been written.
+ */
+static int smrsim_criteria_cond(int criteria,
+                                __u8 *cond,
+                                bool *written)
+{
+   *written = false;
+   switch (criteria) {
+      case ZONE_MATCH_FULL:
+         *cond = Z_COND_FULL;
+         break;
+      case ZONE_MATCH_NFULL:
+         *cond = Z_COND_CLOSED;
+         *written = true;
+         break;
+      case ZONE_MATCH_FREE:
+         *cond = Z_COND_EMPTY;
+         break;
+      case ZONE_MATCH_RNLY:
+         *cond = Z_COND_RO;
+         break;
+      case ZONE_MATCH_OFFL:
+         *cond = Z_COND_OFFLINE;
+         break;
+      default:
+         return -EINVAL;
+   }
+   return 0;
+}
+
 int smrsim_query_zones(sector_t lba, 
                        int criteria, 
                        __u32 *num_zones, 
@@ -1738,120 +5271,43 @@ int smrsim_query_zones(sector_t lba,
    int   idx32;
    __u32 num32;
    __u32 zone_idx;
+   bool  written;
+   __u8  cond;
 
    if (!num_zones || !ptr) {
       printk(KERN_ERR "smrsim: null pointer passed through\n");
       return -EINVAL;
    }
-   mutex_lock(&smrsim_zone_lock);
+   down_read(&smrsim_zone_lock);
    zone_idx = lba >> SMR_BLOCK_SIZE_SHIFT 
                   >> SMR_ZONE_SIZE_SHIFT; 
    if (0 == *num_zones || SMR_NUMZONES < (*num_zones + zone_idx)) {
-      mutex_unlock(&smrsim_zone_lock);
+      up_read(&smrsim_zone_lock);
       printk(KERN_ERR "smrsim:: Number of zone out of range\n");
       return -EINVAL;
    }
-   if (smrsim_dbg_log_enabled) {   
-      smrsim_list_zone_status(zone_status, *num_zones, criteria);
-   }
    if (criteria > 0) {
-      idx32 = 0; 
-      for (num32 = 0; num32 < *num_zones; num32++) {
-         if ((num_sectors_zone() - zone_status[zone_idx + num32].z_write_ptr_offset)
-              >= criteria) {
-            memcpy((ptr + idx32), &zone_status[zone_idx + num32], 
-                   sizeof(struct smrsim_zone_status));
-            idx32++;
-         }
+      *num_zones = smrsim_query_free(zone_idx, zone_idx + *num_zones, criteria,
+                                     *num_zones, ptr, &num32);
+      up_read(&smrsim_zone_lock);
+      if (smrsim_dbg_log_enabled) {   
+         smrsim_list_zone_status(ptr, *num_zones, criteria);
       }
-      *num_zones = idx32;
-      mutex_unlock(&smrsim_zone_lock);
       return 0;      
    }
    switch (criteria) {
       case ZONE_MATCH_ALL:
-         memcpy(ptr, &zone_status[zone_idx], *num_zones * 
-            sizeof(struct smrsim_zone_status));
-         break;
-      case ZONE_MATCH_FULL:
-         idx32 = 0; 
-         for (num32 = zone_idx; num32 < SMR_NUMZONES; num32++) {
-            if (Z_COND_FULL == zone_status[num32].z_conds) {
-               memcpy((ptr + idx32), &zone_status[num32], 
-                       sizeof(struct smrsim_zone_status));
-               idx32++;
-               if (idx32 == *num_zones) {
-                  break;
-               }
-            }
-         }
-         *num_zones = idx32;
-         break;
-      case ZONE_MATCH_NFULL:
-         idx32 = 0;
-         for (num32 = zone_idx; num32 < SMR_NUMZONES; num32++) {
-            if ((Z_COND_CLOSED == zone_status[num32].z_conds) &&
-                zone_status[num32].z_write_ptr_offset) {
-               memcpy((ptr + idx32), &zone_status[num32], 
-                       sizeof(struct smrsim_zone_status));
-               idx32++;
-               if (idx32 == *num_zones) {
-                  break;
-               }
-            }
-         }
-         *num_zones = idx32;
-         break;
-      case ZONE_MATCH_FREE:
-         idx32 = 0;
-         for (num32 = zone_idx; num32 < SMR_NUMZONES; num32++) {
-            if ((Z_COND_EMPTY == zone_status[num32].z_conds)) {
-               memcpy((ptr + idx32), &zone_status[num32], 
-                       sizeof(struct smrsim_zone_status));
-               idx32++;
-               if (idx32 == *num_zones) {
-                  break;
-               }
-            }
-         }
-         *num_zones = idx32;
-         break;
-      case ZONE_MATCH_RNLY:
-         idx32 = 0;
-         for (num32 = zone_idx; num32 < SMR_NUMZONES; num32++) {
-            if (Z_COND_RO == zone_status[num32].z_conds) {
-               memcpy((ptr + idx32), &zone_status[num32], 
-                       sizeof(struct smrsim_zone_status));
-               idx32++;
-               if (idx32 == *num_zones) {
-                  break;
-               }
-            }
-         }
-         *num_zones = idx32;
-         break;
-      case ZONE_MATCH_OFFL:
-         idx32 = 0;
-         for (num32 = zone_idx; num32 < SMR_NUMZONES; num32++) {
-            if (Z_COND_OFFLINE == zone_status[num32].z_conds) {
-               memcpy((ptr + idx32), &zone_status[num32], 
-                       sizeof(struct smrsim_zone_status));
-               idx32++;
-               if (idx32 == *num_zones) {
-                  break;
-               }
-            }
+         for (num32 = 0; num32 < *num_zones; num32++) {
+            smrsim_zone_copy(ptr + num32, zone_idx + num32);
          }
-         *num_zones = idx32;
          break;
       #if 0  /* future support */
       case ZONE_MATCH_WNEC:
          idx32 = 0;
          for (num32 = zone_idx; num32 < SMR_NUMZONES; num32++) {
-            if (zone_status[num32].z_write_ptr_offset !=
+            if (zone_wp[num32] !=
                 zone_status[num32].z_checkpoint_offset ) {
-               memcpy((ptr + idx32), &zone_status[num32], 
-                       sizeof(struct smrsim_zone_status));
+               smrsim_zone_copy(ptr + idx32, num32);
                idx32++;
                if (idx32 == *num_zones) {
                   break;
@@ -1862,13 +5318,117 @@ int smrsim_query_zones(sector_t lba,
          break;
       #endif 
       default:
-         printk("smrsim: wrong query parameter\n");
+         if (smrsim_criteria_cond(criteria, &cond, &written)) {
+            printk("smrsim: wrong query parameter\n");
+            break;
+         }
+         *num_zones = smrsim_query_cond(zone_idx, cond, written, *num_zones, ptr, &num32);
+   }
+   up_read(&smrsim_zone_lock);
+   if (smrsim_dbg_log_enabled) {   
+      smrsim_list_zone_status(ptr, *num_zones, criteria);
    }
-   mutex_unlock(&smrsim_zone_lock);
    return 0;
 }
 EXPORT_SYMBOL(smrsim_query_zones);
 
+/*
+ * Cursor based zone report
+ *
+ * Zones are gathered SMR_REPORT_CHUNK at a time into a buffer on the
+ * stack and copied to the user buffer with smrsim_zone_lock dropped, so
+ * a report of any length needs no allocation, and a fault on the user
+ * buffer may do IO to the device.
+ */
+#define SMR_REPORT_CHUNK  16
+
+union smrsim_report_chunk {
+   struct smrsim_zone_status zs[SMR_REPORT_CHUNK];
+   __u64                     ent[SMR_REPORT_CHUNK];
+};
+
+/*
+ * Gather up to max records from *zone_idx on and move *zone_idx past
+ * the last zone looked at. Caller holds smrsim_zone_lock shared.
+ */
+static __u32 smrsim_report_fill(struct smrsim_zone_report *rep,
+                                __u32 *zone_idx,
+                                __u32 max,
+                                union smrsim_report_chunk *chunk)
+{
+   struct smrsim_zone_status zs;
+   __u32 end = min(*zone_idx + max, SMR_NUMZONES);
+   __u32 nr = 0;
+   bool  written;
+   __u8  cond;
+
+   if (rep->format == SMRSIM_REPORT_PARTIAL) {
+      for (; *zone_idx < end; (*zone_idx)++) {
+         smrsim_zone_copy(&zs, *zone_idx);
+         chunk->ent[nr++] = SMRSIM_ZMAP_ENT(zs.z_write_ptr_offset, zs.z_conds, zs.z_type);
+      }
+   } else if (rep->criteria == ZONE_MATCH_ALL) {
+      for (; *zone_idx < end; (*zone_idx)++) {
+         smrsim_zone_copy(chunk->zs + nr++, *zone_idx);
+      }
+   } else if (rep->criteria > 0) {
+      nr = smrsim_query_free(*zone_idx, SMR_NUMZONES, rep->criteria, max,
+                             chunk->zs, zone_idx);
+   } else {
+      smrsim_criteria_cond(rep->criteria, &cond, &written);
+      nr = smrsim_query_cond(*zone_idx, cond, written, max, chunk->zs, zone_idx);
+   }
+   return nr;
+}
+
+static int smrsim_zone_report(struct smrsim_zone_report *rep)
+{
+   union smrsim_report_chunk chunk;
+   __u8 __user *buf = (__u8 __user *)(unsigned long)rep->buf;
+   size_t rsize;
+   bool   written;
+   __u8   cond;
+   __u32  zone_idx;
+   __u32  done = 0;
+   __u32  nr;
+
+   if (rep->format == SMRSIM_REPORT_PARTIAL) {
+      if (rep->criteria != ZONE_MATCH_ALL) {
+         return -EINVAL;
+      }
+      rsize = sizeof(__u64);
+   } else if (rep->format == SMRSIM_REPORT_FULL) {
+      if ((rep->criteria < 0) && smrsim_criteria_cond(rep->criteria, &cond, &written)) {
+         return -EINVAL;
+      }
+      rsize = sizeof(struct smrsim_zone_status);
+   } else {
+      return -EINVAL;
+   }
+   if (!buf) {
+      return -EINVAL;
+   }
+   zone_idx = min_t(__u64, rep->lba >> SMR_BLOCK_SIZE_SHIFT >> SMR_ZONE_SIZE_SHIFT, ~0U);
+   while (done < rep->num_zones) {
+      down_read(&smrsim_zone_lock);
+      if (zone_idx >= SMR_NUMZONES) {
+         up_read(&smrsim_zone_lock);
+         break;
+      }
+      nr = smrsim_report_fill(rep, &zone_idx,
+                              min_t(__u32, rep->num_zones - done, SMR_REPORT_CHUNK), &chunk);
+      up_read(&smrsim_zone_lock);
+      if (nr && copy_to_user(buf + done * rsize, &chunk, nr * rsize)) {
+         return -EFAULT;
+      }
+      done += nr;
+      cond_resched();
+   }
+   rep->num_zones = done;
+   rep->next_lba  = (zone_idx < SMR_NUMZONES) ? zone_idx_lba(zone_idx) : ~0ULL;
+   return 0;
+}
+
 #ifdef SMRSIM_WP_RT
 int smrsim_forward_wp_adjust(__u8 flag)
 {
@@ -1896,27 +5456,29 @@ int smrsim_border_across(__u64 param)
    __u32 zone_idx = (__u32)(param >> 8);
    enum smrsim_rt_bodr code = (param & 0xff);
     
+   down_write(&smrsim_zone_lock);
    switch (code) {
       case SMR_BODR_CROSS_CUR:
-         zone_status[zone_idx].z_flag = code;
+         zone_flag[zone_idx] = code;
          break;
       case SMR_BODR_CROSS_OFF:
          for (loop = 0; loop < SMR_NUMZONES; loop++)
          {
-            zone_status[loop].z_flag = code;
+            zone_flag[loop] = code;
          }
          break;
       case SMR_BODR_CROSS_SEQ:
          for (loop = 0; loop < SMR_NUMZONES; loop++)
          {
-            if (zone_status[loop].z_type == Z_TYPE_SEQUENTIAL) {
-               zone_status[loop].z_flag = code;
+            if (zone_type[loop] == Z_TYPE_SEQUENTIAL) {
+               zone_flag[loop] = code;
             }
          }   
          break;
       default:
          printk("smrsim: wrong ioctl code for cross border evaluation\n");
    }
+   up_write(&smrsim_zone_lock);
    return 0;
 }
 EXPORT_SYMBOL(smrsim_border_across);
@@ -1929,7 +5491,11 @@ int smrsim_ioctl(struct dm_target* ti,
    smrsim_zbc_query          *zbc_query;
    struct smrsim_dev_config   pconf;
    struct smrsim_zone_status  pstatus;
+   struct smrsim_zone_wpinfo  wpinfo;
+   struct smrsim_zone_report  zreport;
    struct smrsim_stats       *pstats;
+   struct smrsim_stats64     *pstats64;
+   struct smrsim_stats64      hstats64;
    int                        ret = 0;
    __u32                      size  = 0;
    __u64                      num64;
@@ -2029,6 +5595,7 @@ int smrsim_ioctl(struct dm_target* ti,
              printk(KERN_ERR "smrsim: set default zone size failed\n");
              goto ioerr;
           }
+          smrsim_zone_split_update(ti);
           smrsim_ptask.flag |= SMR_CONFIG_CHANGE;
           trace_smrsim_ioctl_evt("IOCTL_SMRSIM_SET_SIZZONEDEFAULT", param);
           break;
@@ -2045,7 +5612,6 @@ int smrsim_ioctl(struct dm_target* ti,
              printk(KERN_ERR "smrsim: reset zone write pointer failed\n");
              goto ioerr;
           }
-          smrsim_ptask.flag |= SMR_CONFIG_CHANGE;
           trace_smrsim_ioctl_evt("IOCTL_SMRSIM_ZBC_RESET_ZONE", num64);
           break;
        case IOCTL_SMRSIM_ZBC_QUERY:
@@ -2091,6 +5657,49 @@ int smrsim_ioctl(struct dm_target* ti,
         zfail:
            kfree(zbc_query);
            goto ioerr;
+       case IOCTL_SMRSIM_ZONE_REPORT:
+          if ((__u64)arg == 0) {
+             printk(KERN_ERR "smrsim: bad parameter\n");
+             goto ioerr; 
+          }
+          if (copy_from_user(&zreport, (struct smrsim_zone_report *)arg, 
+                             sizeof(struct smrsim_zone_report))) {
+             printk(KERN_ERR "smrsim: copy zone report from user memory failed\n");
+             goto ioerr;
+          }
+          trace_smrsim_zbcquery_evt("IOCTL_SMRSIM_ZONE_REPORT", zreport.lba,
+                                    zreport.criteria, zreport.num_zones);
+          if (smrsim_zone_report(&zreport)) {
+             printk(KERN_ERR "smrsim: zone report failed\n");
+             goto ioerr;
+          }
+          if (copy_to_user((struct smrsim_zone_report *)arg, &zreport, 
+                           sizeof(struct smrsim_zone_report))) {
+             printk(KERN_ERR "smrsim: copy zone report to user memory failed\n");
+             goto ioerr;
+          }
+          break;
+       case IOCTL_SMRSIM_GET_ZONE_WP:
+          if ((__u64)arg == 0) {
+             printk(KERN_ERR "smrsim: bad parameter\n");
+             goto ioerr; 
+          }
+          if (copy_from_user(&wpinfo, (struct smrsim_zone_wpinfo *)arg, 
+                             sizeof(struct smrsim_zone_wpinfo))) {
+             printk(KERN_ERR "smrsim: copy zone wp from user memory failed\n");
+             goto ioerr;
+          }
+          trace_smrsim_ioctl_evt("IOCTL_SMRSIM_GET_ZONE_WP", wpinfo.zone_idx);
+          if (smrsim_get_zone_wp(&wpinfo)) {
+             printk(KERN_ERR "smrsim: get zone wp failed\n");
+             goto ioerr;
+          }
+          if (copy_to_user((struct smrsim_zone_wpinfo *)arg, &wpinfo, 
+                           sizeof(struct smrsim_zone_wpinfo))) {
+             printk(KERN_ERR "smrsim: copy zone wp to user memory failed\n");
+             goto ioerr;
+          }
+          break;
        /*
         * SMRSIM stats IOCTLs
         */
@@ -2124,9 +5733,47 @@ int smrsim_ioctl(struct dm_target* ti,
        sfail:
           kfree(pstats);
           goto ioerr;
+       case IOCTL_SMRSIM_GET_STATS64:
+          if ((__u64)arg == 0) {
+             printk(KERN_ERR "smrsim: bad parameter\n");
+             goto ioerr; 
+          }
+          if (copy_from_user(&hstats64, (struct smrsim_stats64 *)arg, 
+                             sizeof(struct smrsim_stats64))) {
+             printk(KERN_ERR "smrsim: copy stats64 header from user memory failed\n");
+             goto ioerr;
+          }
+          hstats64.num_zones = min(hstats64.num_zones, SMR_NUMZONES);
+          size = offsetof(struct smrsim_stats64, zone_stats) +
+                 max(hstats64.num_zones, 1U) * sizeof(struct smrsim_zone_stats64);
+          pstats64 = vzalloc(size);
+          if (!pstats64) {
+             printk(KERN_ERR "smrsim: no enough memory to hold stats\n");
+             goto ioerr;
+          }
+          trace_smrsim_stats_evt("IOCTL_SMRSIM_GET_STATS64", size);
+          pstats64->num_zones = hstats64.num_zones;
+          if (smrsim_get_stats64(pstats64)) {
+             printk(KERN_ERR "smrsim: get stats64 failed\n");
+             vfree(pstats64);
+             goto ioerr;
+          }
+          size = offsetof(struct smrsim_stats64, zone_stats) +
+                 min(hstats64.num_zones, pstats64->num_zones) * 
+                 sizeof(struct smrsim_zone_stats64);
+          if (copy_to_user((struct smrsim_stats64 *)arg, pstats64, size)) {
+             printk(KERN_ERR "smrsim: get stats64 failed as insufficient user memory\n");
+             vfree(pstats64);
+             goto ioerr;
+          }
+          vfree(pstats64);
+          break;
        case IOCTL_SMRSIM_RESET_STATS:
           trace_smrsim_stats_evt("IOCTL_SMRSIM_RESET_STATS", 0);
-          if (smrsim_reset_stats()) {
+          down_write(&smrsim_zone_lock);
+          ret = smrsim_reset_stats();
+          up_write(&smrsim_zone_lock);
+          if (ret) {
              printk(KERN_ERR "smrsim: reset stats failed\n"); 
              goto ioerr;
           }
@@ -2146,7 +5793,6 @@ int smrsim_ioctl(struct dm_target* ti,
              printk(KERN_ERR "smrsim: reset zone stats on lba failed\n");
              goto ioerr;
           }
-          smrsim_ptask.flag |= SMR_CONFIG_CHANGE;
           break;
        /*
         * SMRSIM config IOCTLs
@@ -2156,6 +5802,7 @@ int smrsim_ioctl(struct dm_target* ti,
           if (smrsim_reset_default_config()) {
              goto ioerr;
           }
+          smrsim_zone_split_update(ti);
           #ifdef SMRSIM_WP_RT
           if (smrsim_backward_wp_reset(0)) {
              printk(KERN_ERR "smrsim: turn off reset flag failed\n");
@@ -2173,6 +5820,7 @@ int smrsim_ioctl(struct dm_target* ti,
           if (smrsim_reset_default_zone_config()) {
              goto ioerr;
           }
+          smrsim_zone_split_update(ti);
           smrsim_ptask.flag |= SMR_CONFIG_CHANGE;
           break;
        case IOCTL_SMRSIM_RESET_DEVCONFIG:
@@ -2180,7 +5828,6 @@ int smrsim_ioctl(struct dm_target* ti,
           if (smrsim_reset_default_device_config()) {
              goto ioerr;
           }
-          smrsim_ptask.flag |= SMR_CONFIG_CHANGE;
           break;
        case IOCTL_SMRSIM_GET_DEVCONFIG:
           if (smrsim_get_device_config(&pconf)) {
@@ -2209,7 +5856,6 @@ int smrsim_ioctl(struct dm_target* ti,
           if (smrsim_set_device_rconfig(&pconf)) {
              goto ioerr;
           }
-          smrsim_ptask.flag |= SMR_CONFIG_CHANGE;
           break;
        case IOCTL_SMRSIM_SET_DEVWCONFIG:
           if ((__u64)arg == 0) {
@@ -2224,7 +5870,6 @@ int smrsim_ioctl(struct dm_target* ti,
           if (smrsim_set_device_wconfig(&pconf)) {
              goto ioerr;
           }
-          smrsim_ptask.flag |= SMR_CONFIG_CHANGE;
           break;
        case IOCTL_SMRSIM_SET_DEVRCONFIG_DELAY:
           if ((__u64)arg == 0) {
@@ -2239,7 +5884,6 @@ int smrsim_ioctl(struct dm_target* ti,
           if (smrsim_set_device_rconfig_delay(&pconf)) {
              goto ioerr;
           }
-          smrsim_ptask.flag |= SMR_CONFIG_CHANGE;
           break;
        case IOCTL_SMRSIM_SET_DEVWCONFIG_DELAY:
           if ((__u64)arg == 0) {
@@ -2254,7 +5898,6 @@ int smrsim_ioctl(struct dm_target* ti,
           if (smrsim_set_device_wconfig_delay(&pconf)) {
              goto ioerr;
           }
-          smrsim_ptask.flag |= SMR_CONFIG_CHANGE;
           break;
 
        case IOCTL_SMRSIM_CLEAR_ZONECONFIG:
@@ -2347,7 +5990,7 @@ int smrsim_ioctl(struct dm_target* ti,
    }
    
    if (smrsim_ptask.flag & SMR_CONFIG_CHANGE) {
-      wake_up_process(smrsim_ptask.pstore_thread);
+      wake_up(&smrsim_ptask.wq);
    }
    mutex_unlock(&smrsim_ioct_lock);
    return 0;
@@ -2357,6 +6000,7 @@ int smrsim_ioctl(struct dm_target* ti,
    return -EFAULT;
 }
 
+#ifndef SMRSIM_BLK_ZONED
 static int smrsim_merge(struct dm_target* ti, 
                         struct bvec_merge_data* bvm,
                         struct bio_vec* biovec, 
@@ -2373,6 +6017,19 @@ static int smrsim_merge(struct dm_target* ti,
 
    return min(max_size, q->merge_bvec_fn(q, bvm, biovec));
 }
+#endif
+
+static void smrsim_presuspend(struct dm_target *ti)
+{
+   struct smrsim_c *c = ti->private;
+
+   smrsim_drain(c);
+}
+
+static void smrsim_resume(struct dm_target *ti)
+{
+   smrsim_drain_set(ti->private, false);
+}
 
 static int smrsim_iterate_devices(struct dm_target *ti,
                                   iterate_devices_callout_fn fn,
@@ -2391,28 +6048,80 @@ static struct target_type smrsim_target =
    .ctr             = smrsim_ctr,
    .dtr             = smrsim_dtr,
    .map             = smrsim_map,
+   .end_io          = smrsim_end_io,
    .status          = smrsim_status,
+   .presuspend      = smrsim_presuspend,
+   .resume          = smrsim_resume,
+#ifdef SMRSIM_BLK_ZONED
+   .features        = DM_TARGET_ZONED_HM,
+   .report_zones    = smrsim_report_zones,
+   .io_hints        = smrsim_io_hints,
+#else
    .ioctl           = smrsim_ioctl,
    .merge           = smrsim_merge,
+#endif
    .iterate_devices = smrsim_iterate_devices
 };
 
+#ifndef SMRSIM_BLK_ZONED
+static struct target_type smrsim_rq_target = 
+{
+   .name             = "smrsim-rq",
+   .version          = {1, 0, 0},
+   .module           = THIS_MODULE,
+   .ctr              = smrsim_rq_ctr,
+   .dtr              = smrsim_dtr,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0)
+   .map_rq           = smrsim_map_rq,
+#else
+   .clone_and_map_rq = smrsim_clone_and_map_rq,
+   .release_clone_rq = smrsim_release_clone_rq,
+#endif
+   .status           = smrsim_status,
+   .ioctl            = smrsim_ioctl,
+   .iterate_devices  = smrsim_iterate_devices
+};
+#endif
+
 static int __init dm_smrsim_init (void)
 {
    int ret = 0;
 
    printk(KERN_INFO "smrsim: %s called\n", __FUNCTION__);
 
+   if (smrsim_evt_init()) {
+      printk(KERN_ERR "smrsim: rule violation events will not be recorded\n");
+   }
+   if (smrsim_zmap_init()) {
+      printk(KERN_ERR "smrsim: /dev/smrsim_zones will not be available\n");
+   }
    ret = dm_register_target(&smrsim_target);
-   if(0 > ret)
+   if(0 > ret) {
       printk(KERN_ERR "smrsim: register failed: %d", ret);
-
+      smrsim_zmap_exit();
+      smrsim_evt_exit();
+      return ret;
+   }
+#ifndef SMRSIM_BLK_ZONED
+   ret = dm_register_target(&smrsim_rq_target);
+   if(0 > ret) {
+      printk(KERN_ERR "smrsim: register smrsim-rq failed: %d", ret);
+      dm_unregister_target(&smrsim_target);
+      smrsim_zmap_exit();
+      smrsim_evt_exit();
+   }
+#endif
    return ret;
 }
 
 static void dm_smrsim_exit (void)
 {
+#ifndef SMRSIM_BLK_ZONED
+   dm_unregister_target(&smrsim_rq_target);
+#endif
    dm_unregister_target(&smrsim_target);
+   smrsim_zmap_exit();
+   smrsim_evt_exit();
 }
 
 module_init(dm_smrsim_init);
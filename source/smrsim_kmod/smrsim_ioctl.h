@@ -30,6 +30,8 @@
 #define IOCTL_SMRSIM_SET_SIZZONEDEFAULT   _IOW('z',  3, __u32 *)
 #define IOCTL_SMRSIM_ZBC_RESET_ZONE       _IOW('z',  4, __u64 *)
 #define IOCTL_SMRSIM_ZBC_QUERY            _IOWR('z', 5, smrsim_zbc_query *)
+#define IOCTL_SMRSIM_GET_ZONE_WP          _IOWR('z', 6, struct smrsim_zone_wpinfo *)
+#define IOCTL_SMRSIM_ZONE_REPORT          _IOWR('z', 7, struct smrsim_zone_report *)
 
 /*
  *
@@ -48,6 +50,7 @@
 #define IOCTL_SMRSIM_GET_STATS            _IOR('s',  1, struct smrsim_stats *)
 #define IOCTL_SMRSIM_RESET_STATS          _IO('s',   2)
 #define IOCTL_SMRSIM_RESET_ZONESTATS      _IOW('s',  3, __u64 *)
+#define IOCTL_SMRSIM_GET_STATS64          _IOWR('s', 4, struct smrsim_stats64 *)
 
 /*
  *
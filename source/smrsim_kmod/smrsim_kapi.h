@@ -127,6 +127,18 @@ int smrsim_query_zones(sector_t start_sector,
                        __u32 *max_zones,
                        struct smrsim_zone_status *ret_zones);
 
+/*
+ * SMRSIM_GET_ZONE_WP
+ *
+ * Get the submitted and durable write pointers of wpinfo->zone_idx.
+ * They differ while writes are in flight; a failed write rolls the
+ * submitted WP back to the durable one.
+ *
+ * Returns 0 if operation is successful, -EINVAL if zone_idx is out of range.
+ *
+ */
+int smrsim_get_zone_wp(struct smrsim_zone_wpinfo *wpinfo);
+
 /*
  * SMRSIM_FDWPADJST 
  * 
@@ -165,6 +177,18 @@ int smrsim_backward_wp_reset(__u8 flag);
  */
 int smrsim_get_stats(struct smrsim_stats *stats);
 
+/*
+ * SMRSIM_GET_STATS64
+ *
+ * Get SMRSIM stats values as 64-bit counters. stats->num_zones holds
+ * the number of zone_stats entries available on entry and the number
+ * of device zones on return.
+ *
+ * Returns 0 if operation is successful, negative otherwise.
+ *
+ */
+int smrsim_get_stats64(struct smrsim_stats64 *stats);
+
 /*
  * SMRSIM_RESET_STATS
  *
@@ -58,6 +58,42 @@ typedef struct
 
 } smrsim_zbc_query;
 
+/*
+ * Zone report with a cursor. Up to num_zones zones from lba on that
+ * match criteria (as for smrsim_zbc_query) are written to buf, and
+ * next_lba is where the next call resumes, ~0 once past the last zone.
+ * SMRSIM_REPORT_FULL writes struct smrsim_zone_status records,
+ * SMRSIM_REPORT_PARTIAL one 8 byte SMRSIM_ZMAP_ENT() record per zone in
+ * order, so it goes with ZONE_MATCH_ALL only.
+ */
+enum smrsim_report_format {
+   SMRSIM_REPORT_FULL    = 0,
+   SMRSIM_REPORT_PARTIAL = 1
+};
+
+struct smrsim_zone_report
+{
+  __u64     lba;                 /* IN - sectors            */
+  __u64     buf;                 /* IN - user address       */
+  __u64     next_lba;            /* OUT - sectors           */
+  __u32     num_zones;           /* IN/OUT                  */
+  __s32     criteria;            /* IN                      */
+  __u32     format;              /* IN                      */
+  __u32     rsvd;
+};
+
+/*
+ * Submitted WP advances when a write is accepted, durable WP when every
+ * write below it has completed.
+ */
+struct smrsim_zone_wpinfo
+{
+  __u32     zone_idx;            /* IN                      */
+  __u32     swp;                 /* OUT - submitted, sectors */
+  __u32     dwp;                 /* OUT - durable, sectors   */
+  __u32     inflight;            /* OUT - writes in flight   */
+};
+
 struct smrsim_state_header
 {
   __u32  magic;
@@ -103,6 +139,42 @@ struct smrsim_stats
    struct smrsim_zone_stats zone_stats[1];
 };
 
+/*
+ * 64-bit statistics - IOCTL_SMRSIM_GET_STATS64
+ *
+ * num_zones is IN as the number of zone_stats entries the caller
+ * allocated and OUT as the number of zones of the device. The first
+ * min(IN, OUT) entries are filled.
+ */
+#define SMRSIM_STATS64_VERSION  1
+
+struct smrsim_out_of_policy_read_stats64
+{
+    __u64  beyond_swp_count;
+    __u64  span_zones_count;
+};
+
+struct smrsim_out_of_policy_write_stats64
+{
+    __u64  not_on_swp_count;
+    __u64  span_zones_count;
+    __u64  unaligned_count;
+};
+
+struct smrsim_zone_stats64
+{
+    struct smrsim_out_of_policy_read_stats64   out_of_policy_read_stats;
+    struct smrsim_out_of_policy_write_stats64  out_of_policy_write_stats;
+};
+
+struct smrsim_stats64
+{
+   __u32                      version;     /* OUT           */
+   __u32                      num_zones;   /* IN/OUT        */
+   struct smrsim_dev_stats    dev_stats;   /* OUT           */
+   struct smrsim_zone_stats64 zone_stats[1];
+};
+
 struct smrsim_dev_config
 {
   /*
@@ -121,6 +193,12 @@ struct smrsim_config
 };
 
 
+/*
+ * Bytes of a metadata slot, descriptor page included. A zone size whose
+ * struct smrsim_state image can't fit the rest is refused.
+ */
+#define SMRSIM_PSTORE_SLOT  (2 << 20)
+
 struct smrsim_state
 {
    struct smrsim_state_header header;
@@ -128,6 +206,56 @@ struct smrsim_state
    struct smrsim_stats        stats;
 };
 
+/*
+ * Rule violation event, read in binary from /dev/smrsim_evt. err is the
+ * SMR_ERR_* code, ts a per cpu clock in ns.
+ */
+struct smrsim_evt
+{
+   __u64  ts;
+   __u64  lba;          /* sectors       */
+   __u32  len;          /* sectors       */
+   __u32  zone_idx;
+   __s32  err;
+   __u32  cpu;
+};
+
+/*
+ * Live zone table, mapped read only from /dev/smrsim_zones: a header page
+ * followed by pages of 64 bit entries, zone n in entry n % SMRSIM_ZMAP_ENTS
+ * of entry page n / SMRSIM_ZMAP_ENTS. Each entry is stored whole, then
+ * its page gen is bumped. A reader that sees retired set must map the
+ * device again: the zone table was reallocated.
+ */
+#define SMRSIM_ZMAP_MAGIC    0x534D524D   /* "SMRM" */
+#define SMRSIM_ZMAP_VERSION  1
+#define SMRSIM_ZMAP_PAGE     4096
+#define SMRSIM_ZMAP_ENTS     ((SMRSIM_ZMAP_PAGE - 8) / 8)
+
+#define SMRSIM_ZMAP_ENT(wp, cond, type) \
+   ((__u64)(wp) | ((__u64)(cond) << 32) | ((__u64)(type) << 40))
+#define SMRSIM_ZMAP_WP(ent)    ((__u32)(ent))                /* sectors */
+#define SMRSIM_ZMAP_COND(ent)  ((__u8)((ent) >> 32))
+#define SMRSIM_ZMAP_TYPE(ent)  ((__u8)((ent) >> 40))
+
+struct smrsim_zmap_hdr
+{
+   __u32  magic;
+   __u32  version;
+   __u32  num_zones;
+   __u32  zone_sectors;
+   __u32  pages;        /* entry pages */
+   __u32  gen;          /* bumped as zones are added or cleared */
+   __u32  retired;
+};
+
+struct smrsim_zmap_page
+{
+   __u32  gen;
+   __u32  rsvd;
+   __u64  ent[SMRSIM_ZMAP_ENTS];
+};
+
 /*
  * see ZBCQUERY comments below for define details
  */
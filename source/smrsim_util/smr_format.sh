@@ -35,13 +35,15 @@ if [[ x"${smr_device}" == x"" ]]; then
    exit 1
 fi
 
-# Computer number of 256 MB zones leaving room for persistence data after last zone.
+# Computer number of 256 MB zones leaving room for persistence data after last zone:
+# two 2 MB slots, written alternately, and a 2 MB journal.
+pstore_bytes=$((3*2*1024*1024))
 device_size_bytes=`blockdev --getsize64 ${smr_device}`
-zones=$(bc <<< "($device_size_bytes-1)/(256*1024*1024)")
-ublk=$(bc <<< "(256*1024*1024*(($device_size_bytes-1)/(256*1024*1024)))/512")
+zones=$(bc <<< "($device_size_bytes-$pstore_bytes)/(256*1024*1024)")
+ublk=$(bc <<< "(256*1024*1024*$zones)/512")
 
-# Initialize 2 MB at the end of the device for SMRSim persistence data.
-dd if=/dev/zero of=${smr_device} bs=4096 seek=$((ublk+1)) count=512 2> /dev/null 1> /dev/null
+# Initialize 6 MB after the last zone for SMRSim persistence data.
+dd if=/dev/zero of=${smr_device} bs=4096 seek=$((ublk/8)) count=$((pstore_bytes/4096)) 2> /dev/null 1> /dev/null
 
 if [[ $show_zones -eq 1 ]]; then
    echo "$zones"
@@ -17,12 +17,15 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <linux/types.h>
+#include <linux/fs.h>
 
 /* 
  * The following user app codes are utility tools and also show examples. 
@@ -56,6 +59,7 @@ int smrsim_util_print_help()
     printf("Show last write error    : smrsim_util /dev/mapper/smrsim e 2\n");
     printf("Enable logging           : smrsim_util /dev/mapper/smrsim e 3\n");
     printf("Disable logging          : smrsim_util /dev/mapper/smrsim e 4\n");
+    printf("Drain violation events   : smrsim_util /dev/mapper/smrsim e 5\n");
     printf("\n");
     printf("Get number of zones      : smrsim_util /dev/mapper/smrsim z 1\n");
     printf("Get default zone size    : smrsim_util /dev/mapper/smrsim z 2\n");
@@ -67,6 +71,9 @@ int smrsim_util_print_help()
     printf("ZBC query zone status    : smrsim_util /dev/mapper/smrsim z 6 <number_of_zones>\n");
     printf("ZBC query zone status    : smrsim_util /dev/mapper/smrsim z 7 <lba>\n");
     printf("ZBC query zone status    : smrsim_util /dev/mapper/smrsim z 8 <zone_index>\n");
+    printf("Get zone write pointers  : smrsim_util /dev/mapper/smrsim z 9 <zone_index>\n");
+    printf("Map live zone table      : smrsim_util /dev/mapper/smrsim z 10 <number_of_zones>\n");
+    printf("Scan zones with a cursor : smrsim_util /dev/mapper/smrsim z 11 <zones_per_call>\n");
     printf("\n"); 
     printf("Get all zone stats       : smrsim_util /dev/mapper/smrsim s 1\n");
     printf("Get zone stats           : smrsim_util /dev/mapper/smrsim s 2 <number_of_zones>\n");
@@ -74,6 +81,7 @@ int smrsim_util_print_help()
     printf("Reset all zone stats     : smrsim_util /dev/mapper/smrsim s 4\n");
     printf("Reset zone stats by lba  : smrsim_util /dev/mapper/smrsim s 5 <lba>\n");
     printf("Reset zone stats by idx  : smrsim_util /dev/mapper/smrsim s 6 <zone_index>\n");
+    printf("Get 64-bit zone stats    : smrsim_util /dev/mapper/smrsim s 7 <number_of_zones>\n");
     printf("\n");
     printf("Set all default config   : smrsim_util /dev/mapper/smrsim l 1\n");
     printf("Set zone default config  : smrsim_util /dev/mapper/smrsim l 2\n");
@@ -100,6 +108,32 @@ int smrsim_util_print_help()
     return 0;
 }
 
+/*
+ * Drain the binary rule violation events the driver recorded since the
+ * last drain.
+ */
+void smrsim_report_events(void)
+{
+    struct smrsim_evt evt[64];
+    ssize_t           len;
+    int               efd;
+    size_t            i;
+
+    efd = open("/dev/smrsim_evt", O_RDONLY);
+    if (-1 == efd) {
+        printf("Error: /dev/smrsim_evt open failed\n");
+        return;
+    }
+    while ((len = read(efd, evt, sizeof(evt))) > 0) {
+        for (i = 0; i < len / sizeof(struct smrsim_evt); i++) {
+            printf("%llu.%09llu cpu %u zone %u lba %llu sectors %u err %d\n",
+                   evt[i].ts / 1000000000ULL, evt[i].ts % 1000000000ULL,
+                   evt[i].cpu, evt[i].zone_idx, evt[i].lba, evt[i].len, evt[i].err);
+        }
+    }
+    close(efd);
+}
+
 void smrsim_err_iot(int fd, int seq)
 {
     int num = 0;
@@ -134,6 +168,9 @@ void smrsim_err_iot(int fd, int seq)
                 printf("Operation failed\n");
             }
             break;
+        case 5:
+            smrsim_report_events();
+            break;
         default:
             printf("ioctl error: Invalid command\n");
     }
@@ -194,6 +231,115 @@ void smrsim_report_zbc_query(smrsim_zbc_query *zbc_query)
    }
 }
 
+/*
+ * Read WP, condition and type of the first num zones from the live zone
+ * table mapped from /dev/smrsim_zones, without an ioctl per query.
+ */
+void smrsim_report_zmap(u32 num)
+{
+    struct smrsim_zmap_hdr  *hdr;
+    struct smrsim_zmap_page *pg;
+    size_t                   len;
+    u64                      ent;
+    u32                      idx;
+    int                      zfd;
+
+    zfd = open("/dev/smrsim_zones", O_RDONLY);
+    if (-1 == zfd) {
+        printf("Error: /dev/smrsim_zones open failed\n");
+        return;
+    }
+    hdr = mmap(NULL, SMRSIM_ZMAP_PAGE, PROT_READ, MAP_SHARED, zfd, 0);
+    if (MAP_FAILED == hdr) {
+        printf("Error: /dev/smrsim_zones mmap failed\n");
+        close(zfd);
+        return;
+    }
+    if ((SMRSIM_ZMAP_MAGIC != hdr->magic) || (SMRSIM_ZMAP_VERSION != hdr->version)) {
+        printf("Error: unknown zone map format\n");
+        munmap(hdr, SMRSIM_ZMAP_PAGE);
+        close(zfd);
+        return;
+    }
+    len = (1 + hdr->pages) * SMRSIM_ZMAP_PAGE;
+    munmap(hdr, SMRSIM_ZMAP_PAGE);
+    hdr = mmap(NULL, len, PROT_READ, MAP_SHARED, zfd, 0);
+    close(zfd);
+    if (MAP_FAILED == hdr) {
+        printf("Error: /dev/smrsim_zones mmap failed\n");
+        return;
+    }
+    pg = (struct smrsim_zmap_page *)((char *)hdr + SMRSIM_ZMAP_PAGE);
+    if (!num || num > hdr->num_zones) {
+        num = hdr->num_zones;
+    }
+    printf("zones: %u zone size: %u sectors\n", hdr->num_zones, hdr->zone_sectors);
+    for (idx = 0; idx < num; idx++) {
+        ent = pg[idx / SMRSIM_ZMAP_ENTS].ent[idx % SMRSIM_ZMAP_ENTS];
+        printf("zone[%u] wp: %u cond: 0x%x type: 0x%x\n", idx,
+               SMRSIM_ZMAP_WP(ent), SMRSIM_ZMAP_COND(ent), SMRSIM_ZMAP_TYPE(ent));
+    }
+    if (hdr->retired) {
+        printf("zone table was reallocated, map again for current zones\n");
+    }
+    munmap(hdr, len);
+}
+
+/*
+ * Scan all zones with IOCTL_SMRSIM_ZONE_REPORT, batch zones per call in
+ * the 8 byte partial record format.
+ */
+void smrsim_scan_zones(int fd, u32 batch)
+{
+    struct smrsim_zone_report rep;
+    u64                      *ent;
+    u32                       idx;
+    u32                       zone_idx = 0;
+
+    ent = malloc(batch * sizeof(u64));
+    if (!ent) {
+        printf("Unable to allocate memory\n");
+        return;
+    }
+    memset(&rep, 0, sizeof(rep));
+    rep.format = SMRSIM_REPORT_PARTIAL;
+    rep.criteria = ZONE_MATCH_ALL;
+    rep.buf = (unsigned long)ent;
+    do {
+        rep.num_zones = batch;
+        if (ioctl(fd, IOCTL_SMRSIM_ZONE_REPORT, &rep)) {
+            printf("Operation failed\n");
+            break;
+        }
+        for (idx = 0; idx < rep.num_zones; idx++, zone_idx++) {
+            printf("zone[%u] wp: %u cond: 0x%x type: 0x%x\n", zone_idx,
+                   SMRSIM_ZMAP_WP(ent[idx]), SMRSIM_ZMAP_COND(ent[idx]),
+                   SMRSIM_ZMAP_TYPE(ent[idx]));
+        }
+        rep.lba = rep.next_lba;
+    } while (rep.num_zones && (rep.next_lba != ~0ULL));
+    free(ent);
+}
+
+/*
+ * The driver refuses a zone size whose metadata image can't fit a slot
+ * less its descriptor page; check the same before asking it.
+ */
+int smrsim_util_image_fits(int fd, u32 size_zone)
+{
+    u64  bytes;
+    u64  num_zones;
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (!size_zone || (page <= 0) || ioctl(fd, BLKGETSIZE64, &bytes)) {
+        return 1;
+    }
+    num_zones = (bytes >> 9) / size_zone;
+    bytes = offsetof(struct smrsim_state, stats.zone_stats) + sizeof(u32) +
+            num_zones * (sizeof(struct smrsim_zone_stats) + sizeof(struct smrsim_zone_status));
+    return (bytes + page - 1) / page <= (u64)(SMRSIM_PSTORE_SLOT / page - 1);
+}
+
 void smrsim_zone_iot(int fd, int seq, char *argv[])
 {
    u32 num32     = 0;
@@ -202,6 +348,7 @@ void smrsim_zone_iot(int fd, int seq, char *argv[])
    u64 lba       = 0;
    u8  num8      = 0;         
    smrsim_zbc_query  *zbc_query;
+   struct smrsim_zone_wpinfo wpinfo;
 
    switch(seq)
    {
@@ -226,6 +373,10 @@ void smrsim_zone_iot(int fd, int seq, char *argv[])
              break;
          }
          num32 = atoi(argv[4]);
+         if (!smrsim_util_image_fits(fd, num32)) {
+            printf("Zone size %u gives more zones than a metadata slot holds\n", num32);
+            break;
+         }
          if (!ioctl(fd, IOCTL_SMRSIM_SET_SIZZONEDEFAULT, &num32)) {
             printf("Set zone default size: %u\n", num32);
          } else {
@@ -432,6 +583,33 @@ void smrsim_zone_iot(int fd, int seq, char *argv[])
              printf("Operation failed\n");
          }
          break; 
+      case 9:
+         if (argv[4] == NULL) {
+             smrsim_util_print_help();
+             break;
+         }
+         wpinfo.zone_idx = atoi(argv[4]);
+         if (!ioctl(fd, IOCTL_SMRSIM_GET_ZONE_WP, &wpinfo)) {
+            printf("zone[%u] submitted wp: %u durable wp: %u writes in flight: %u\n",
+                   wpinfo.zone_idx, wpinfo.swp, wpinfo.dwp, wpinfo.inflight);
+         } else {
+            printf("Operation failed\n");
+         }
+         break;
+      case 10:
+         if (argv[4] == NULL) {
+             smrsim_util_print_help();
+             break;
+         }
+         smrsim_report_zmap(atoi(argv[4]));
+         break;
+      case 11:
+         if ((argv[4] == NULL) || (atoi(argv[4]) <= 0)) {
+             smrsim_util_print_help();
+             break;
+         }
+         smrsim_scan_zones(fd, atoi(argv[4]));
+         break;
       default:
          printf("ioctl error: Invalid command.\n");
    }
@@ -481,9 +659,34 @@ void smrsim_report_stats(struct smrsim_stats  *stats, u32 num32)
     }
 }
 
+void smrsim_report_stats64(struct smrsim_stats64 *stats, u32 num32)
+{
+    u32 i = 0;
+    printf("\nStats version: %u\n", stats->version);
+    printf("Device idle time max: %u\n",
+            stats->dev_stats.idle_stats.dev_idle_time_max);
+    printf("Device idle time min: %u\n",
+            stats->dev_stats.idle_stats.dev_idle_time_min);
+   
+    for (i = 0; i < num32; i++) {
+       printf("zone[%u] smrsim out of policy read stats: beyond wp count: %llu\n",
+                i, stats->zone_stats[i].out_of_policy_read_stats.beyond_swp_count);
+       printf("zone[%u] smrsim out of policy read stats: span zones count: %llu\n",
+                i, stats->zone_stats[i].out_of_policy_read_stats.span_zones_count);
+       printf("zone[%u] smrsim out of policy write stats: not on wp count: %llu\n",
+                i, stats->zone_stats[i].out_of_policy_write_stats.not_on_swp_count);
+       printf("zone[%u] smrsim out of policy write stats: span zones count: %llu\n",
+                i, stats->zone_stats[i].out_of_policy_write_stats.span_zones_count);
+       printf("zone[%u] smrsim out of policy write stats: unaligned count: %llu\n",
+                i, stats->zone_stats[i].out_of_policy_write_stats.unaligned_count);
+       printf("\n");
+    }
+}
+
 void smrsim_stats_iot(int fd, int seq, char *argv[])
 {
-   struct smrsim_stats *stats;
+   struct smrsim_stats   *stats;
+   struct smrsim_stats64 *stats64;
    u32    num32     = 0;
    u32    num_zones = 0; 
    u64    num64     = 0;
@@ -582,6 +785,31 @@ void smrsim_stats_iot(int fd, int seq, char *argv[])
             printf("Operation failed\n");
          }
          break;
+      case 7:
+         if (argv[4] == NULL) {
+            smrsim_util_print_help();
+            break;
+         }
+         num32 = atoi(argv[4]);
+         if (num32 > num_zones) {
+            printf("Too much zones specified\n");
+            break;
+         }
+         stats64 = (struct smrsim_stats64 *)malloc(sizeof(struct smrsim_stats64)
+            + sizeof(struct smrsim_zone_stats64) * num32);
+         if (!stats64) {
+            printf("No enough memory to continue.\n");
+            break;
+         }
+         stats64->num_zones = num32;
+         if (!ioctl(fd, IOCTL_SMRSIM_GET_STATS64, stats64)) {
+            printf("Get Stats:\n");
+            smrsim_report_stats64(stats64, num32);
+         } else {
+            printf("Operation failed\n");
+         }
+         free(stats64);
+         break;
       default:
          printf("ioctl error: Invalid command.\n");
    }